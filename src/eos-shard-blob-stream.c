@@ -21,6 +21,7 @@
 
 #include "eos-shard-blob-stream.h"
 #include "eos-shard-blob.h"
+#include "eos-shard-codec.h"
 #include "eos-shard-enums.h"
 #include "eos-shard-shard-file.h"
 
@@ -34,8 +35,37 @@ struct _EosShardBlobStream
   goffset pos;
   EosShardBlob *blob;
   EosShardShardFile *shard_file;
+
+  /* Running checksum of the packed data, as long as it is being read
+   * sequentially from the start. hashed_pos is -1 after a read elsewhere,
+   * until the stream is rewound. NULL once the blob has been checked, or
+   * if it doesn't need to be. */
+  GChecksum *checksum;
+  goffset hashed_pos;
+
+  /* For chunked blobs, pos is in uncompressed coordinates, and we keep
+   * the most recently decoded chunk around. The chunk table is loaded on
+   * the first read. */
+  gboolean chunked;
+  gboolean have_chunk_table;
+  struct chunk_table chunk_table;
+  int64_t chunk_idx;
+  uint8_t *chunk;
+  uint8_t *packed_chunk;
+
+  /* Read-ahead buffer for the packed data, holding readahead_len bytes
+   * from readahead_start. The window doubles while reads stay sequential
+   * and drops back to the minimum when they don't. */
+  uint8_t *readahead;
+  gsize readahead_window;
+  goffset readahead_start;
+  gsize readahead_len;
+  goffset last_read_end;
 };
 
+#define READAHEAD_MIN_SIZE (16 * 1024)
+#define READAHEAD_MAX_SIZE (1024 * 1024)
+
 static void seekable_iface_init (GSeekableIface *iface);
 static goffset eos_shard_blob_stream_tell (GSeekable *seekable);
 static gboolean eos_shard_blob_stream_can_seek (GSeekable *seekable);
@@ -76,6 +106,16 @@ eos_shard_blob_stream_can_seek (GSeekable *seekable)
   return TRUE;
 }
 
+/* The size of the stream, in the coordinates pos is in. */
+static gsize
+stream_size (EosShardBlobStream *self)
+{
+  if (self->chunked)
+    return eos_shard_blob_get_content_size (self->blob);
+  else
+    return eos_shard_blob_get_packed_content_size (self->blob);
+}
+
 // This method implementation is pretty much copied wholesale from Gio's
 // GMemoryInputStream, since the internal models are basically identical
 static gboolean
@@ -90,7 +130,7 @@ eos_shard_blob_stream_seek (GSeekable *seekable,
   gsize blob_content_size;
 
   self = EOS_SHARD_BLOB_STREAM (seekable);
-  blob_content_size = eos_shard_blob_get_packed_content_size (self->blob);
+  blob_content_size = stream_size (self);
 
   switch (type) {
     case G_SEEK_CUR:
@@ -140,6 +180,184 @@ eos_shard_blob_stream_truncate (GSeekable *seekable,
   return FALSE;
 }
 
+/* Feeds the data just read at @pos into the running checksum, and checks
+ * it once we've hashed the whole blob. */
+static gboolean
+update_checksum (EosShardBlobStream  *self,
+                 const void          *buffer,
+                 gsize                count,
+                 goffset              pos,
+                 GError             **error)
+{
+  if (self->checksum == NULL)
+    return TRUE;
+
+  /* Rewinding to the start lets us verify again from scratch. */
+  if (pos == 0 && self->hashed_pos != 0) {
+    g_checksum_reset (self->checksum);
+    self->hashed_pos = 0;
+  }
+
+  /* We can only verify sequential reads. */
+  if (pos != self->hashed_pos) {
+    self->hashed_pos = -1;
+    return TRUE;
+  }
+
+  g_checksum_update (self->checksum, buffer, count);
+  self->hashed_pos += count;
+
+  if (self->hashed_pos < eos_shard_blob_get_packed_content_size (self->blob))
+    return TRUE;
+
+  g_autoptr(GChecksum) checksum = g_steal_pointer (&self->checksum);
+  if (!_eos_shard_blob_check_checksum (self->blob, checksum, error))
+    return FALSE;
+
+  _eos_shard_shard_file_mark_blob_verified (self->shard_file, self->blob);
+  return TRUE;
+}
+
+static gboolean
+read_packed_data (EosShardBlobStream *self, void *buffer, gsize count, goffset offset, GError **error)
+{
+  gsize size_read = _eos_shard_shard_file_read_data (self->shard_file, buffer, count,
+                                                     eos_shard_blob_get_offset (self->blob) + offset);
+  int read_error = errno;
+  if (size_read == -1) {
+    g_set_error (error, EOS_SHARD_ERROR, EOS_SHARD_ERROR_BLOB_STREAM_READ,
+                 "Read failed: %s", strerror (read_error));
+    return FALSE;
+  }
+
+  if (size_read != count) {
+    g_set_error (error, EOS_SHARD_ERROR, EOS_SHARD_ERROR_BLOB_STREAM_READ,
+                 "Short read");
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+static gboolean
+load_chunk_table (EosShardBlobStream *self, GError **error)
+{
+  gsize packed_size = eos_shard_blob_get_packed_content_size (self->blob);
+  gsize uncompressed_size = eos_shard_blob_get_content_size (self->blob);
+  struct chunk_table_header hdr = { 0, };
+
+  gsize table_size = MIN (sizeof (hdr), packed_size);
+  if (!read_packed_data (self, &hdr, table_size, 0, error))
+    return FALSE;
+
+  /* Read as much of the table as the header says there is, and let
+   * chunk_table_init() check the rest. */
+  if (table_size == sizeof (hdr))
+    table_size = MIN (chunk_table_size (hdr.n_chunks), packed_size);
+
+  g_autofree uint8_t *buf = g_malloc (table_size);
+  if (!read_packed_data (self, buf, table_size, 0, error))
+    return FALSE;
+
+  if (!chunk_table_init (&self->chunk_table, buf, table_size, packed_size, uncompressed_size, error))
+    return FALSE;
+
+  self->chunk = g_malloc (self->chunk_table.chunk_size);
+  self->have_chunk_table = TRUE;
+  return TRUE;
+}
+
+static gboolean
+load_chunk (EosShardBlobStream *self, uint32_t idx, GError **error)
+{
+  struct chunk_table *table = &self->chunk_table;
+  uint64_t start = table->offsets[idx];
+  gsize packed_length = table->offsets[idx + 1] - start;
+
+  self->packed_chunk = g_realloc (self->packed_chunk, packed_length);
+  if (!read_packed_data (self, self->packed_chunk, packed_length, start, error))
+    return FALSE;
+
+  gsize length = chunk_table_chunk_length (table, eos_shard_blob_get_content_size (self->blob), idx);
+  if (!codec_decode_into (eos_shard_blob_get_flags (self->blob), _eos_shard_blob_get_zstd_ddict (self->blob),
+                          self->packed_chunk, packed_length,
+                          self->chunk, length, error)) {
+    self->chunk_idx = -1;
+    return FALSE;
+  }
+
+  self->chunk_idx = idx;
+  return TRUE;
+}
+
+static gssize
+read_chunked (EosShardBlobStream *self, void *buffer, gsize count, GError **error)
+{
+  gsize size = eos_shard_blob_get_content_size (self->blob);
+
+  if (self->pos >= size)
+    return 0;
+
+  if (!self->have_chunk_table && !load_chunk_table (self, error))
+    return -1;
+
+  struct chunk_table *table = &self->chunk_table;
+  uint32_t idx = self->pos / table->chunk_size;
+
+  if (self->chunk_idx != idx && !load_chunk (self, idx, error))
+    return -1;
+
+  gsize chunk_offset = self->pos - (goffset) idx * table->chunk_size;
+  gsize chunk_length = chunk_table_chunk_length (table, size, idx);
+  gsize actual_count = MIN (count, chunk_length - chunk_offset);
+
+  memcpy (buffer, self->chunk + chunk_offset, actual_count);
+  self->pos += actual_count;
+  return actual_count;
+}
+
+/* Copies packed data at pos into @buffer, refilling the read-ahead buffer
+ * if it doesn't hold any. */
+static gssize
+read_buffered (EosShardBlobStream *self, void *buffer, gsize count, GError **error)
+{
+  gsize size = eos_shard_blob_get_packed_content_size (self->blob);
+
+  if (self->pos >= size)
+    return 0;
+
+  count = MIN (count, size - self->pos);
+
+  if (self->pos < self->readahead_start || self->pos >= self->readahead_start + self->readahead_len) {
+    if (self->pos == self->last_read_end)
+      self->readahead_window = MIN (self->readahead_window * 2, READAHEAD_MAX_SIZE);
+    else
+      self->readahead_window = READAHEAD_MIN_SIZE;
+
+    /* Reads at least as large as the window gain nothing from the copy. */
+    if (count >= self->readahead_window) {
+      if (!read_packed_data (self, buffer, count, self->pos, error))
+        return -1;
+      self->last_read_end = self->pos + count;
+      return count;
+    }
+
+    gsize length = MIN (self->readahead_window, size - self->pos);
+    self->readahead = g_realloc (self->readahead, self->readahead_window);
+    self->readahead_len = 0;
+    if (!read_packed_data (self, self->readahead, length, self->pos, error))
+      return -1;
+    self->readahead_start = self->pos;
+    self->readahead_len = length;
+  }
+
+  gsize buffer_offset = self->pos - self->readahead_start;
+  count = MIN (count, self->readahead_len - buffer_offset);
+  memcpy (buffer, self->readahead + buffer_offset, count);
+  self->last_read_end = self->pos + count;
+  return count;
+}
+
 static gssize
 eos_shard_blob_stream_read (GInputStream  *stream,
                             void          *buffer,
@@ -148,27 +366,157 @@ eos_shard_blob_stream_read (GInputStream  *stream,
                             GError       **error)
 {
   EosShardBlobStream *self = EOS_SHARD_BLOB_STREAM (stream);
-  gsize actual_count, size_read;
-  int read_error;
-  goffset blob_offset;
-  gsize blob_content_size;
 
-  blob_offset = eos_shard_blob_get_offset (self->blob);
-  blob_content_size = eos_shard_blob_get_packed_content_size (self->blob);
-  actual_count = MIN (count, blob_content_size - self->pos);
+  if (self->chunked)
+    return read_chunked (self, buffer, count, error);
 
-  size_read = _eos_shard_shard_file_read_data (self->shard_file, buffer, actual_count, blob_offset + self->pos);
-  read_error = errno;
-  if (size_read == -1) {
-    g_set_error (error, EOS_SHARD_ERROR, EOS_SHARD_ERROR_BLOB_STREAM_READ,
-                 "Read failed: %s", strerror (read_error));
+  gssize size_read = read_buffered (self, buffer, count, error);
+  if (size_read < 0)
+    return -1;
+
+  if (!update_checksum (self, buffer, size_read, self->pos, error))
     return -1;
-  }
 
   self->pos += size_read;
   return size_read;
 }
 
+/* Whether the next read can be served without touching the disk. */
+static gboolean
+can_read_without_blocking (EosShardBlobStream *self)
+{
+  if (self->pos >= stream_size (self))
+    return TRUE;
+
+  if (self->chunked)
+    return self->chunk_idx >= 0 && self->pos / self->chunk_table.chunk_size == self->chunk_idx;
+  else
+    return self->pos >= self->readahead_start && self->pos < self->readahead_start + self->readahead_len;
+}
+
+struct read_async_data
+{
+  void *buffer;
+  gsize count;
+};
+
+static void
+read_async_func (gpointer data, gpointer user_data)
+{
+  g_autoptr(GTask) task = data;
+  struct read_async_data *rd = g_task_get_task_data (task);
+  GError *error = NULL;
+
+  if (g_task_return_error_if_cancelled (task))
+    return;
+
+  gssize size_read = eos_shard_blob_stream_read (g_task_get_source_object (task), rd->buffer, rd->count,
+                                                 g_task_get_cancellable (task), &error);
+  if (size_read < 0)
+    g_task_return_error (task, error);
+  else
+    g_task_return_int (task, size_read);
+}
+
+/* Blob reads are short, blocking preads, so rather than spawning a GIO
+ * worker job per read, all streams share one small pool of I/O threads. */
+static GThreadPool *
+get_io_pool (void)
+{
+  static gsize io_pool = 0;
+
+  if (g_once_init_enter (&io_pool)) {
+    GThreadPool *pool = g_thread_pool_new (read_async_func, NULL, g_get_num_processors (), FALSE, NULL);
+    g_once_init_leave (&io_pool, (gsize) pool);
+  }
+
+  return (GThreadPool *) io_pool;
+}
+
+static void
+eos_shard_blob_stream_read_async (GInputStream        *stream,
+                                  void                *buffer,
+                                  gsize                count,
+                                  int                  io_priority,
+                                  GCancellable        *cancellable,
+                                  GAsyncReadyCallback  callback,
+                                  gpointer             user_data)
+{
+  EosShardBlobStream *self = EOS_SHARD_BLOB_STREAM (stream);
+  GTask *task = g_task_new (stream, cancellable, callback, user_data);
+  g_task_set_source_tag (task, eos_shard_blob_stream_read_async);
+  g_task_set_priority (task, io_priority);
+
+  if (can_read_without_blocking (self)) {
+    GError *error = NULL;
+    gssize size_read = eos_shard_blob_stream_read (stream, buffer, count, cancellable, &error);
+    if (size_read < 0)
+      g_task_return_error (task, error);
+    else
+      g_task_return_int (task, size_read);
+    g_object_unref (task);
+    return;
+  }
+
+  struct read_async_data *rd = g_new0 (struct read_async_data, 1);
+  rd->buffer = buffer;
+  rd->count = count;
+  g_task_set_task_data (task, rd, g_free);
+
+  g_thread_pool_push (get_io_pool (), task, NULL);
+}
+
+static gssize
+eos_shard_blob_stream_read_finish (GInputStream  *stream,
+                                   GAsyncResult  *result,
+                                   GError       **error)
+{
+  g_return_val_if_fail (g_task_is_valid (result, stream), -1);
+
+  return g_task_propagate_int (G_TASK (result), error);
+}
+
+/* Skipping only moves pos, so it never needs to touch the disk. */
+static gssize
+eos_shard_blob_stream_skip (GInputStream  *stream,
+                            gsize          count,
+                            GCancellable  *cancellable,
+                            GError       **error)
+{
+  EosShardBlobStream *self = EOS_SHARD_BLOB_STREAM (stream);
+  gsize size = stream_size (self);
+
+  if (self->pos >= size)
+    return 0;
+
+  count = MIN (count, size - self->pos);
+  self->pos += count;
+  return count;
+}
+
+static void
+eos_shard_blob_stream_skip_async (GInputStream        *stream,
+                                  gsize                count,
+                                  int                  io_priority,
+                                  GCancellable        *cancellable,
+                                  GAsyncReadyCallback  callback,
+                                  gpointer             user_data)
+{
+  g_autoptr(GTask) task = g_task_new (stream, cancellable, callback, user_data);
+  g_task_set_source_tag (task, eos_shard_blob_stream_skip_async);
+  g_task_return_int (task, eos_shard_blob_stream_skip (stream, count, cancellable, NULL));
+}
+
+static gssize
+eos_shard_blob_stream_skip_finish (GInputStream  *stream,
+                                   GAsyncResult  *result,
+                                   GError       **error)
+{
+  g_return_val_if_fail (g_task_is_valid (result, stream), -1);
+
+  return g_task_propagate_int (G_TASK (result), error);
+}
+
 static gboolean
 eos_shard_blob_stream_close (GInputStream  *stream,
                              GCancellable  *cancellable,
@@ -184,6 +532,11 @@ eos_shard_blob_stream_dispose (GObject *object)
 
   g_clear_pointer (&self->blob, eos_shard_blob_unref);
   g_clear_object (&self->shard_file);
+  g_clear_pointer (&self->checksum, g_checksum_free);
+  chunk_table_dispose (&self->chunk_table);
+  g_clear_pointer (&self->chunk, g_free);
+  g_clear_pointer (&self->packed_chunk, g_free);
+  g_clear_pointer (&self->readahead, g_free);
 
   G_OBJECT_CLASS (eos_shard_blob_stream_parent_class)->dispose (object);
 }
@@ -199,12 +552,20 @@ eos_shard_blob_stream_class_init (EosShardBlobStreamClass *klass)
 
   istream_class = G_INPUT_STREAM_CLASS (klass);
   istream_class->read_fn  = eos_shard_blob_stream_read;
+  istream_class->read_async = eos_shard_blob_stream_read_async;
+  istream_class->read_finish = eos_shard_blob_stream_read_finish;
+  istream_class->skip = eos_shard_blob_stream_skip;
+  istream_class->skip_async = eos_shard_blob_stream_skip_async;
+  istream_class->skip_finish = eos_shard_blob_stream_skip_finish;
   istream_class->close_fn = eos_shard_blob_stream_close;
 }
 
 static void
-eos_shard_blob_stream_init (EosShardBlobStream *blob_stream)
+eos_shard_blob_stream_init (EosShardBlobStream *self)
 {
+  self->chunk_idx = -1;
+  self->readahead_window = READAHEAD_MIN_SIZE;
+  self->last_read_end = -1;
 }
 
 EosShardBlobStream *
@@ -214,5 +575,18 @@ _eos_shard_blob_stream_new_for_blob (EosShardBlob *blob,
   EosShardBlobStream *self = g_object_new (EOS_SHARD_TYPE_BLOB_STREAM, NULL);
   self->blob = eos_shard_blob_ref (blob);
   self->shard_file = g_object_ref (shard_file);
+
+  self->chunked = (eos_shard_blob_get_flags (blob) & EOS_SHARD_BLOB_FLAG_CHUNKED) != 0;
+
+  /* Whoever opens a stream is going to read it, so get the kernel started
+   * on the packed data now. */
+  _eos_shard_shard_file_advise_willneed (shard_file,
+                                         eos_shard_blob_get_offset (blob),
+                                         eos_shard_blob_get_packed_content_size (blob));
+
+  /* We don't read chunked blobs in packed order, so we can't verify them. */
+  if (!self->chunked && _eos_shard_shard_file_should_verify_blob (shard_file, blob))
+    self->checksum = g_checksum_new (G_CHECKSUM_SHA256);
+
   return self;
 }
@@ -20,7 +20,16 @@
 #include "config.h"
 
 #include "eos-shard-blob.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <zstd.h>
+
+#include "eos-shard-enums.h"
+#include "eos-shard-lz4-converter.h"
 #include "eos-shard-shard-file.h"
+#include "eos-shard-zstd-converter.h"
 
 EosShardBlob *
 _eos_shard_blob_new (void)
@@ -30,10 +39,30 @@ _eos_shard_blob_new (void)
   return blob;
 }
 
+/* Compares the digest of @checksum, which must be a SHA-256 over the blob's
+ * packed contents, against the checksum stored in the shard. */
+gboolean
+_eos_shard_blob_check_checksum (EosShardBlob *blob, GChecksum *checksum, GError **error)
+{
+  uint8_t checksum_buf[32];
+  size_t checksum_buf_len = sizeof (checksum_buf);
+  g_checksum_get_digest (checksum, checksum_buf, &checksum_buf_len);
+  g_assert (checksum_buf_len == sizeof (checksum_buf));
+
+  if (memcmp (checksum_buf, blob->checksum, sizeof (checksum_buf)) != 0) {
+    g_set_error (error, EOS_SHARD_ERROR, EOS_SHARD_ERROR_BLOB_CHECKSUM_MISMATCH,
+                 "Could not load blob: checksum did not match");
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
 static void
 eos_shard_blob_free (EosShardBlob *blob)
 {
   g_clear_object (&blob->shard_file);
+  g_free (blob->name);
   g_free (blob->content_type);
   g_free (blob);
 }
@@ -41,14 +70,14 @@ eos_shard_blob_free (EosShardBlob *blob)
 EosShardBlob *
 eos_shard_blob_ref (EosShardBlob *blob)
 {
-  blob->ref_count++;
+  g_atomic_int_inc (&blob->ref_count);
   return blob;
 }
 
 void
 eos_shard_blob_unref (EosShardBlob *blob)
 {
-  if (--blob->ref_count == 0)
+  if (g_atomic_int_dec_and_test (&blob->ref_count))
     eos_shard_blob_free (blob);
 }
 
@@ -65,12 +94,94 @@ eos_shard_blob_get_content_type (EosShardBlob *blob)
   return (const char *) blob->content_type;
 }
 
+/**
+ * eos_shard_blob_get_name:
+ *
+ * Get the name the blob is stored under in its record, as passed to
+ * eos_shard_record_lookup_blob().
+ *
+ * Returns: (nullable): the blob's name, or %NULL if the shard doesn't
+ *   store blob names
+ */
+const char *
+eos_shard_blob_get_name (EosShardBlob *blob)
+{
+  return (const char *) blob->name;
+}
+
+/* Returns a new compressor for the compression format in @flags, or %NULL
+ * if @flags doesn't ask for compression. */
+GConverter *
+_eos_shard_new_compressor_for_flags (EosShardBlobFlags flags, int zstd_level)
+{
+  if (flags & EOS_SHARD_BLOB_FLAG_COMPRESSED_LZ4)
+    return G_CONVERTER (_eos_shard_lz4_converter_new_compressor ());
+  else if (flags & EOS_SHARD_BLOB_FLAG_COMPRESSED_ZSTD)
+    return G_CONVERTER (_eos_shard_zstd_converter_new_compressor (zstd_level, NULL));
+  else if (flags & EOS_SHARD_BLOB_FLAG_COMPRESSED_ZLIB)
+    return G_CONVERTER (g_zlib_compressor_new (G_ZLIB_COMPRESSOR_FORMAT_ZLIB, -1));
+  else
+    return NULL;
+}
+
+/* Whether the blob's packed data needs decoding to get at its content. */
+gboolean
+_eos_shard_blob_is_compressed (EosShardBlob *blob)
+{
+  return (blob->flags & (EOS_SHARD_BLOB_FLAG_COMPRESSED_ZLIB |
+                         EOS_SHARD_BLOB_FLAG_COMPRESSED_ZSTD |
+                         EOS_SHARD_BLOB_FLAG_COMPRESSED_LZ4 |
+                         EOS_SHARD_BLOB_FLAG_CHUNKED)) != 0;
+}
+
+/* Returns a new decompressor for the blob's packed data, or %NULL if it is
+ * stored uncompressed. Chunked blobs are decoded by #EosShardBlobStream
+ * itself, so they get %NULL as well. */
+GConverter *
+_eos_shard_blob_new_decompressor (EosShardBlob *blob)
+{
+  EosShardBlobFlags flags = blob->flags;
+
+  if (flags & EOS_SHARD_BLOB_FLAG_CHUNKED)
+    return NULL;
+  else if (flags & EOS_SHARD_BLOB_FLAG_COMPRESSED_LZ4)
+    return G_CONVERTER (_eos_shard_lz4_converter_new_decompressor (blob->uncompressed_size));
+  else if (flags & EOS_SHARD_BLOB_FLAG_COMPRESSED_ZSTD)
+    return G_CONVERTER (_eos_shard_zstd_converter_new_decompressor (_eos_shard_blob_get_zstd_ddict (blob)));
+  else if (flags & EOS_SHARD_BLOB_FLAG_COMPRESSED_ZLIB)
+    return G_CONVERTER (g_zlib_decompressor_new (G_ZLIB_COMPRESSOR_FORMAT_ZLIB));
+  else
+    return NULL;
+}
+
+/* Returns the zstd dictionary the blob was compressed against, if any. */
+const ZSTD_DDict *
+_eos_shard_blob_get_zstd_ddict (EosShardBlob *blob)
+{
+  if (!blob->zstd_dictionary)
+    return NULL;
+
+  return _eos_shard_shard_file_get_zstd_ddict (blob->shard_file);
+}
+
 /**
  * eos_shard_blob_get_stream:
  *
  * Creates and returns a #GInputStream to the blob's content. If the blob is
- * compressed, the returned stream will be streamed through a
- * #GZlibDecompressor, yielding decompressed data.
+ * compressed, the returned stream will be streamed through a decompressor,
+ * yielding decompressed data.
+ *
+ * Blobs stored with %EOS_SHARD_BLOB_FLAG_CHUNKED are the exception: their
+ * stream decodes one chunk at a time, and is a #GSeekable in uncompressed
+ * coordinates, so seeking to any position only decodes the chunk
+ * containing it.
+ *
+ * As long as the stream is read sequentially, the blob's checksum is
+ * verified along the way, following the shard file's checksum policy. If it
+ * doesn't match, the read that reaches the end of the blob fails with
+ * %EOS_SHARD_ERROR_BLOB_CHECKSUM_MISMATCH. Chunked blobs are only verified
+ * by eos_shard_blob_load_contents() and eos_shard_shard_file_verify_all(),
+ * since checking them here would mean reading every chunk.
  *
  * Returns: (transfer full): a new GInputStream for the blob's data
  */
@@ -83,18 +194,17 @@ eos_shard_blob_get_stream (EosShardBlob *blob)
 
   g_autoptr(GInputStream) blob_stream = G_INPUT_STREAM (_eos_shard_blob_stream_new_for_blob (blob, blob->shard_file));
 
-  if (blob->flags & EOS_SHARD_BLOB_FLAG_COMPRESSED_ZLIB) {
-    g_autoptr(GZlibDecompressor) decompressor = g_zlib_decompressor_new (G_ZLIB_COMPRESSOR_FORMAT_ZLIB);
-    return g_converter_input_stream_new (blob_stream, G_CONVERTER (decompressor));
-  } else {
+  g_autoptr(GConverter) decompressor = _eos_shard_blob_new_decompressor (blob);
+  if (decompressor != NULL)
+    return g_converter_input_stream_new (blob_stream, decompressor);
+  else
     return g_object_ref (blob_stream);
-  }
 }
 
 /**
  * eos_shard_blob_get_flags:
  *
- * Currently, the only flag is one which indicates whether the content is
+ * Currently, the only flags indicate whether and how the content is
  * compressed. Since the two blob read methods decompress content
  * automatically, this method is really only useful internally.
  *
@@ -137,6 +247,10 @@ eos_shard_blob_get_content_size (EosShardBlob *blob)
  * Synchronously read and return the contents of this
  * blob as a #GBytes.
  *
+ * If the blob is stored uncompressed and the shard file could be mapped
+ * into memory, the returned #GBytes references the mapped file directly
+ * rather than holding a copy of the data.
+ *
  * Returns: (transfer full): the blob's data
  */
 GBytes *
@@ -146,6 +260,326 @@ eos_shard_blob_load_contents (EosShardBlob  *blob,
   return _eos_shard_shard_file_load_blob (blob->shard_file, blob, error);
 }
 
+static void
+load_contents_thread (GTask        *task,
+                      gpointer      source_object,
+                      gpointer      task_data,
+                      GCancellable *cancellable)
+{
+  EosShardBlob *blob = task_data;
+  GError *error = NULL;
+
+  GBytes *bytes = eos_shard_blob_load_contents (blob, &error);
+  if (bytes == NULL)
+    g_task_return_error (task, error);
+  else
+    g_task_return_pointer (task, bytes, (GDestroyNotify) g_bytes_unref);
+}
+
+/**
+ * eos_shard_blob_load_contents_async:
+ * @blob: an #EosShardBlob
+ * @cancellable: (allow-none): a #GCancellable
+ * @callback: the function to call when the contents are loaded
+ * @user_data: user data to pass to @callback
+ *
+ * Asynchronous version of eos_shard_blob_load_contents(). The blob is read
+ * and decompressed in a worker thread.
+ */
+void
+eos_shard_blob_load_contents_async (EosShardBlob        *blob,
+                                    GCancellable        *cancellable,
+                                    GAsyncReadyCallback  callback,
+                                    gpointer             user_data)
+{
+  g_autoptr(GTask) task = g_task_new (NULL, cancellable, callback, user_data);
+  g_task_set_source_tag (task, eos_shard_blob_load_contents_async);
+  g_task_set_task_data (task, eos_shard_blob_ref (blob), (GDestroyNotify) eos_shard_blob_unref);
+  g_task_run_in_thread (task, load_contents_thread);
+}
+
+/**
+ * eos_shard_blob_load_contents_finish:
+ * @blob: an #EosShardBlob
+ * @result: the #GAsyncResult passed to the callback
+ * @error: return location for a #GError
+ *
+ * Returns: (transfer full): the blob's data
+ */
+GBytes *
+eos_shard_blob_load_contents_finish (EosShardBlob  *blob,
+                                     GAsyncResult  *result,
+                                     GError       **error)
+{
+  g_return_val_if_fail (g_task_is_valid (result, NULL), NULL);
+  g_return_val_if_fail (g_task_get_source_tag (G_TASK (result)) == eos_shard_blob_load_contents_async, NULL);
+
+  return g_task_propagate_pointer (G_TASK (result), error);
+}
+
+/**
+ * eos_shard_blob_load_contents_into:
+ * @blob: an #EosShardBlob
+ * @buf: (out caller-allocates) (array length=buf_len) (element-type guint8):
+ *   a buffer to hold the blob's contents
+ * @buf_len: the size of @buf, which must be at least
+ *   eos_shard_blob_get_content_size()
+ * @error: return location for a #GError
+ *
+ * Like eos_shard_blob_load_contents(), but reads the contents into memory
+ * owned by the caller. Compressed blobs are decoded straight into @buf,
+ * without any intermediate copies.
+ *
+ * Returns: %TRUE if the whole contents were loaded into @buf
+ */
+gboolean
+eos_shard_blob_load_contents_into (EosShardBlob  *blob,
+                                   guint8        *buf,
+                                   gsize          buf_len,
+                                   GError       **error)
+{
+  g_return_val_if_fail (buf_len >= blob->uncompressed_size, FALSE);
+
+  return _eos_shard_shard_file_load_blob_into (blob->shard_file, blob, buf, error);
+}
+
+static gssize
+read_packed_range (EosShardBlob *blob, guint8 *buf, gsize len, goffset offset, GError **error)
+{
+  gsize total = 0;
+
+  while (total < len) {
+    gssize size_read = _eos_shard_shard_file_read_data (blob->shard_file, buf + total, len - total,
+                                                        blob->offs + offset + total);
+    if (size_read < 0) {
+      int read_error = errno;
+      if (read_error == EINTR)
+        continue;
+      g_set_error (error, EOS_SHARD_ERROR, EOS_SHARD_ERROR_BLOB_STREAM_READ,
+                   "Read failed: %s", strerror (read_error));
+      return -1;
+    }
+    if (size_read == 0)
+      break;
+    total += size_read;
+  }
+
+  return total;
+}
+
+/* Returns the blob's content stream, positioned at @offset. */
+static GInputStream *
+open_stream_at (EosShardBlob *blob, goffset offset, GError **error)
+{
+  g_autoptr(GInputStream) stream = eos_shard_blob_get_stream (blob);
+
+  /* Chunked blobs can jump straight to the chunk holding @offset; anything
+   * else has to be decoded from the start. */
+  if (G_IS_SEEKABLE (stream) && g_seekable_can_seek (G_SEEKABLE (stream))) {
+    if (!g_seekable_seek (G_SEEKABLE (stream), offset, G_SEEK_SET, NULL, error))
+      return NULL;
+  } else {
+    goffset skipped = 0;
+    while (skipped < offset) {
+      gssize n = g_input_stream_skip (stream, offset - skipped, NULL, error);
+      if (n < 0)
+        return NULL;
+      if (n == 0)
+        break;
+      skipped += n;
+    }
+  }
+
+  return g_steal_pointer (&stream);
+}
+
+static gssize
+read_decoded_range (EosShardBlob *blob, guint8 *buf, gsize len, goffset offset, GError **error)
+{
+  g_autoptr(GInputStream) stream = open_stream_at (blob, offset, error);
+  if (stream == NULL)
+    return -1;
+
+  gsize size_read;
+  if (!g_input_stream_read_all (stream, buf, len, &size_read, NULL, error))
+    return -1;
+
+  return size_read;
+}
+
+/**
+ * eos_shard_blob_read_into: (skip)
+ * @blob: an #EosShardBlob
+ * @buf: a buffer to read into
+ * @len: the maximum number of bytes to read
+ * @offset: the offset into the blob's content to start reading at
+ * @error: return location for a #GError
+ *
+ * Reads up to @len bytes of the blob's content, starting at @offset, into
+ * memory owned by the caller. The content is decompressed as needed. Fewer
+ * than @len bytes are only returned when the end of the blob is reached.
+ *
+ * Unlike eos_shard_blob_load_contents(), this does not verify the blob's
+ * checksum, since that needs the whole packed blob.
+ *
+ * Returns: the number of bytes read, 0 if @offset is at or past the end of
+ *   the content, or -1 on error
+ */
+gssize
+eos_shard_blob_read_into (EosShardBlob  *blob,
+                          guint8        *buf,
+                          gsize          len,
+                          goffset        offset,
+                          GError       **error)
+{
+  g_return_val_if_fail (offset >= 0, -1);
+  g_return_val_if_fail (len <= G_MAXSSIZE, -1);
+
+  if ((guint64) offset >= blob->uncompressed_size)
+    return 0;
+
+  len = MIN (len, blob->uncompressed_size - offset);
+
+  if (!_eos_shard_blob_is_compressed (blob))
+    return read_packed_range (blob, buf, len, offset, error);
+  else
+    return read_decoded_range (blob, buf, len, offset, error);
+}
+
+static gboolean
+write_all_to_fd (int out_fd, const guint8 *buf, gsize len, GError **error)
+{
+  while (len > 0) {
+    ssize_t written = write (out_fd, buf, len);
+    if (written < 0) {
+      int write_error = errno;
+      if (write_error == EINTR)
+        continue;
+      g_set_error (error, G_IO_ERROR, g_io_error_from_errno (write_error),
+                   "Write failed: %s", strerror (write_error));
+      return FALSE;
+    }
+    buf += written;
+    len -= written;
+  }
+
+  return TRUE;
+}
+
+/* Copies through a userspace buffer, for when the kernel can't splice
+ * between the shard and @out_fd. */
+static gssize
+copy_packed_range (EosShardBlob *blob, int out_fd, gsize len, goffset offset, GError **error)
+{
+  guint8 buf[64 * 1024];
+  gsize total = 0;
+
+  while (total < len) {
+    gssize size_read = read_packed_range (blob, buf, MIN (sizeof (buf), len - total), offset + total, error);
+    if (size_read < 0)
+      return -1;
+    if (size_read == 0)
+      break;
+    if (!write_all_to_fd (out_fd, buf, size_read, error))
+      return -1;
+    total += size_read;
+  }
+
+  return total;
+}
+
+static gssize
+send_packed_range (EosShardBlob *blob, int out_fd, gsize len, goffset offset, GError **error)
+{
+  gsize total = 0;
+
+  while (total < len) {
+    gssize sent = _eos_shard_shard_file_send_data (blob->shard_file, out_fd, len - total,
+                                                   blob->offs + offset + total);
+    if (sent < 0) {
+      int send_error = errno;
+      if (send_error == EINTR)
+        continue;
+      /* Nothing has gone out yet on these, so fall back to plain copies. */
+      if (send_error == EINVAL || send_error == ENOSYS) {
+        gssize copied = copy_packed_range (blob, out_fd, len - total, offset + total, error);
+        return copied < 0 ? -1 : (gssize) (total + copied);
+      }
+      g_set_error (error, G_IO_ERROR, g_io_error_from_errno (send_error),
+                   "Send failed: %s", strerror (send_error));
+      return -1;
+    }
+    if (sent == 0)
+      break;
+    total += sent;
+  }
+
+  return total;
+}
+
+static gssize
+send_decoded_range (EosShardBlob *blob, int out_fd, gsize len, goffset offset, GError **error)
+{
+  g_autoptr(GInputStream) stream = open_stream_at (blob, offset, error);
+  if (stream == NULL)
+    return -1;
+
+  guint8 buf[64 * 1024];
+  gsize total = 0;
+
+  while (total < len) {
+    gssize size_read = g_input_stream_read (stream, buf, MIN (sizeof (buf), len - total), NULL, error);
+    if (size_read < 0)
+      return -1;
+    if (size_read == 0)
+      break;
+    if (!write_all_to_fd (out_fd, buf, size_read, error))
+      return -1;
+    total += size_read;
+  }
+
+  return total;
+}
+
+/**
+ * eos_shard_blob_send_to_fd:
+ * @blob: an #EosShardBlob
+ * @out_fd: a blocking file descriptor, such as a socket, to write to
+ * @offset: the offset into the blob's content to start at
+ * @len: the maximum number of bytes to send
+ * @error: return location for a #GError
+ *
+ * Writes up to @len bytes of the blob's content, starting at @offset, to
+ * @out_fd. Uncompressed blobs are copied from the shard file by the kernel
+ * with sendfile(), so the data never passes through userspace. Compressed
+ * blobs are decoded and written out piece by piece.
+ *
+ * As with eos_shard_blob_read_into(), the blob's checksum is not verified.
+ *
+ * Returns: the number of bytes written, or -1 on error
+ */
+gssize
+eos_shard_blob_send_to_fd (EosShardBlob  *blob,
+                           int            out_fd,
+                           goffset        offset,
+                           gsize          len,
+                           GError       **error)
+{
+  g_return_val_if_fail (out_fd >= 0, -1);
+  g_return_val_if_fail (offset >= 0, -1);
+  g_return_val_if_fail (len <= G_MAXSSIZE, -1);
+
+  if ((guint64) offset >= blob->uncompressed_size)
+    return 0;
+
+  len = MIN (len, blob->uncompressed_size - offset);
+
+  if (!_eos_shard_blob_is_compressed (blob))
+    return send_packed_range (blob, out_fd, len, offset, error);
+  else
+    return send_decoded_range (blob, out_fd, len, offset, error);
+}
+
 EosShardDictionary *
 eos_shard_blob_load_as_dictionary (EosShardBlob *blob, GError **error)
 {
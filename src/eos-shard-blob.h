@@ -30,6 +30,9 @@ typedef enum
 {
   EOS_SHARD_BLOB_FLAG_NONE,
   EOS_SHARD_BLOB_FLAG_COMPRESSED_ZLIB,
+  EOS_SHARD_BLOB_FLAG_COMPRESSED_ZSTD = 1 << 1,
+  EOS_SHARD_BLOB_FLAG_COMPRESSED_LZ4 = 1 << 2,
+  EOS_SHARD_BLOB_FLAG_CHUNKED = 1 << 3,
 } EosShardBlobFlags;
 
 /**
@@ -40,7 +43,7 @@ typedef enum
  * not.
  *
  * If the content is compressed, its #EosShardBlobStream will be automatically
- * piped through a #GZlibDecompressor.
+ * piped through a decompressor for the blob's compression format.
  **/
 
 GType eos_shard_blob_get_type (void) G_GNUC_CONST;
@@ -50,20 +53,58 @@ struct _EosShardBlob {
   int ref_count;
   EosShardShardFile *shard_file;
 
+  /* The name the blob is stored under in its record, or NULL for V1
+   * shards, which don't name their blobs. */
+  char *name;
   char *content_type;
   EosShardBlobFlags flags;
   uint8_t checksum[0x20];
   uint64_t offs;
   uint64_t size;
   uint64_t uncompressed_size;
+
+  /* Whether the blob is compressed against the shard's zstd dictionary. */
+  gboolean zstd_dictionary;
 };
 
 const char * eos_shard_blob_get_content_type (EosShardBlob *blob);
+const char * eos_shard_blob_get_name (EosShardBlob *blob);
 
 EosShardBlob * _eos_shard_blob_new (void);
+GConverter * _eos_shard_new_compressor_for_flags (EosShardBlobFlags flags, int zstd_level);
+GConverter * _eos_shard_blob_new_decompressor (EosShardBlob *blob);
+gboolean _eos_shard_blob_is_compressed (EosShardBlob *blob);
+#ifndef __GI_SCANNER__
+struct ZSTD_DDict_s;
+const struct ZSTD_DDict_s * _eos_shard_blob_get_zstd_ddict (EosShardBlob *blob);
+#endif
+gboolean _eos_shard_blob_check_checksum (EosShardBlob  *blob,
+                                         GChecksum     *checksum,
+                                         GError       **error);
 
 GBytes * eos_shard_blob_load_contents (EosShardBlob  *blob,
                                        GError       **error);
+void eos_shard_blob_load_contents_async (EosShardBlob        *blob,
+                                         GCancellable        *cancellable,
+                                         GAsyncReadyCallback  callback,
+                                         gpointer             user_data);
+GBytes * eos_shard_blob_load_contents_finish (EosShardBlob  *blob,
+                                              GAsyncResult  *result,
+                                              GError       **error);
+gboolean eos_shard_blob_load_contents_into (EosShardBlob  *blob,
+                                            guint8        *buf,
+                                            gsize          buf_len,
+                                            GError       **error);
+gssize eos_shard_blob_read_into (EosShardBlob  *blob,
+                                 guint8        *buf,
+                                 gsize          len,
+                                 goffset        offset,
+                                 GError       **error);
+gssize eos_shard_blob_send_to_fd (EosShardBlob  *blob,
+                                  int            out_fd,
+                                  goffset        offset,
+                                  gsize          len,
+                                  GError       **error);
 GInputStream * eos_shard_blob_get_stream (EosShardBlob *blob);
 EosShardBlobFlags eos_shard_blob_get_flags (EosShardBlob *blob);
 gsize eos_shard_blob_get_content_size (EosShardBlob *blob);
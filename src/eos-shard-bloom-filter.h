@@ -36,17 +36,25 @@ struct bloom_filter {
   uint32_t *buckets;
 };
 
+/* The number of buckets in one 64-byte block of a blocked filter. */
+#define BLOOM_FILTER_BLOCK_BUCKETS 16
+
 void bloom_filter_init_for_params (struct bloom_filter *self, int n, double p);
+void bloom_filter_init_blocked_for_params (struct bloom_filter *self, int n, double p);
 gboolean bloom_filter_init_for_fd (struct bloom_filter *self,
                                    int fd,
                                    off_t offset,
                                    GError **error);
 
 void bloom_filter_write_to_stream (struct bloom_filter *self, GOutputStream *out);
+size_t bloom_filter_write_to_fd (struct bloom_filter *self, int fd, off_t offset);
 
 void bloom_filter_add (struct bloom_filter *self, const char *key);
 gboolean bloom_filter_test (struct bloom_filter *self, const char *key);
 
+void bloom_filter_add_digest (struct bloom_filter *self, const uint8_t *digest);
+gboolean bloom_filter_test_digest (struct bloom_filter *self, const uint8_t *digest);
+
 void bloom_filter_dispose (struct bloom_filter *self);
 
 #endif /* __GI_SCANNER__ */
@@ -0,0 +1,254 @@
+/* Copyright 2015 Endless Mobile, Inc. */
+
+/* This file is part of eos-shard.
+ *
+ * eos-shard is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * eos-shard is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with eos-shard.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "eos-shard-codec.h"
+
+#include <string.h>
+#include <lz4.h>
+#include <zlib.h>
+
+#include "eos-shard-enums.h"
+
+/* zstd contexts are expensive to set up, so keep one of each per thread. */
+
+static void
+free_cctx (gpointer cctx)
+{
+  ZSTD_freeCCtx (cctx);
+}
+
+static void
+free_dctx (gpointer dctx)
+{
+  ZSTD_freeDCtx (dctx);
+}
+
+static GPrivate cctx_key = G_PRIVATE_INIT (free_cctx);
+static GPrivate dctx_key = G_PRIVATE_INIT (free_dctx);
+
+static ZSTD_CCtx *
+get_cctx (void)
+{
+  ZSTD_CCtx *cctx = g_private_get (&cctx_key);
+  if (cctx == NULL) {
+    cctx = ZSTD_createCCtx ();
+    g_private_set (&cctx_key, cctx);
+  }
+  return cctx;
+}
+
+static ZSTD_DCtx *
+get_dctx (void)
+{
+  ZSTD_DCtx *dctx = g_private_get (&dctx_key);
+  if (dctx == NULL) {
+    dctx = ZSTD_createDCtx ();
+    g_private_set (&dctx_key, dctx);
+  }
+  return dctx;
+}
+
+GBytes *
+codec_encode (EosShardBlobFlags   flags,
+              int                 zstd_level,
+              const ZSTD_CDict   *cdict,
+              const void         *src,
+              gsize               src_size,
+              GError            **error)
+{
+  gsize bound;
+  gsize dst_size;
+  uint8_t *dst;
+
+  if (flags & EOS_SHARD_BLOB_FLAG_COMPRESSED_LZ4) {
+    if (src_size > LZ4_MAX_INPUT_SIZE) {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+                   "Data too large for LZ4 (%" G_GSIZE_FORMAT " bytes)", src_size);
+      return NULL;
+    }
+
+    bound = LZ4_compressBound (src_size);
+    dst = g_malloc (bound);
+    int ret = LZ4_compress_default (src, (char *) dst, src_size, bound);
+    if (ret <= 0)
+      goto fail;
+    dst_size = ret;
+  } else if (flags & EOS_SHARD_BLOB_FLAG_COMPRESSED_ZSTD) {
+    bound = ZSTD_compressBound (src_size);
+    dst = g_malloc (bound);
+    size_t ret;
+    if (cdict != NULL)
+      ret = ZSTD_compress_usingCDict (get_cctx (), dst, bound, src, src_size, cdict);
+    else
+      ret = ZSTD_compressCCtx (get_cctx (), dst, bound, src, src_size, zstd_level);
+    if (ZSTD_isError (ret))
+      goto fail;
+    dst_size = ret;
+  } else if (flags & EOS_SHARD_BLOB_FLAG_COMPRESSED_ZLIB) {
+    uLongf ret = bound = compressBound (src_size);
+    dst = g_malloc (bound);
+    if (compress2 (dst, &ret, src, src_size, Z_DEFAULT_COMPRESSION) != Z_OK)
+      goto fail;
+    dst_size = ret;
+  } else {
+    return g_bytes_new (src, src_size);
+  }
+
+  return g_bytes_new_take (g_realloc (dst, dst_size), dst_size);
+
+ fail:
+  g_free (dst);
+  g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                       "Compression failed");
+  return NULL;
+}
+
+gboolean
+codec_decode_into (EosShardBlobFlags   flags,
+                   const ZSTD_DDict   *ddict,
+                   const void         *src,
+                   gsize               src_size,
+                   void               *dst,
+                   gsize               dst_size,
+                   GError            **error)
+{
+  gsize decoded_size;
+
+  if (flags & EOS_SHARD_BLOB_FLAG_COMPRESSED_LZ4) {
+    if (src_size > G_MAXINT || dst_size > G_MAXINT)
+      goto corrupt;
+
+    int ret = LZ4_decompress_safe (src, dst, src_size, dst_size);
+    if (ret < 0)
+      goto corrupt;
+    decoded_size = ret;
+  } else if (flags & EOS_SHARD_BLOB_FLAG_COMPRESSED_ZSTD) {
+    size_t ret;
+    if (ddict != NULL)
+      ret = ZSTD_decompress_usingDDict (get_dctx (), dst, dst_size, src, src_size, ddict);
+    else
+      ret = ZSTD_decompressDCtx (get_dctx (), dst, dst_size, src, src_size);
+    if (ZSTD_isError (ret))
+      goto corrupt;
+    decoded_size = ret;
+  } else if (flags & EOS_SHARD_BLOB_FLAG_COMPRESSED_ZLIB) {
+    uLongf ret = dst_size;
+    if (uncompress (dst, &ret, src, src_size) != Z_OK)
+      goto corrupt;
+    decoded_size = ret;
+  } else {
+    if (src_size != dst_size)
+      goto corrupt;
+    memcpy (dst, src, src_size);
+    decoded_size = src_size;
+  }
+
+  if (decoded_size != dst_size)
+    goto corrupt;
+
+  return TRUE;
+
+ corrupt:
+  g_set_error_literal (error, EOS_SHARD_ERROR, EOS_SHARD_ERROR_SHARD_FILE_CORRUPT,
+                       "Could not decompress blob data");
+  return FALSE;
+}
+
+gsize
+chunk_table_size (uint32_t n_chunks)
+{
+  return sizeof (struct chunk_table_header) + ((gsize) n_chunks + 1) * sizeof (uint64_t);
+}
+
+void
+chunk_table_write (void *dst, uint32_t chunk_size, uint32_t n_chunks, const uint64_t *offsets)
+{
+  struct chunk_table_header hdr = { chunk_size, n_chunks };
+  memcpy (dst, &hdr, sizeof (hdr));
+  memcpy ((uint8_t *) dst + sizeof (hdr), offsets, (n_chunks + 1) * sizeof (uint64_t));
+}
+
+/* Parses and validates the chunk table at the start of a chunked blob's
+ * packed data. @data only needs to hold the table itself; if @data_size is
+ * too small for it, this fails and the caller can retry with at least
+ * chunk_table_size() bytes. */
+gboolean
+chunk_table_init (struct chunk_table  *self,
+                  const void          *data,
+                  gsize                data_size,
+                  uint64_t             packed_size,
+                  uint64_t             uncompressed_size,
+                  GError             **error)
+{
+  struct chunk_table_header hdr;
+  uint32_t i;
+
+  if (data_size < sizeof (hdr))
+    goto corrupt;
+
+  memcpy (&hdr, data, sizeof (hdr));
+
+  if (hdr.chunk_size == 0)
+    goto corrupt;
+  if (hdr.n_chunks != (uncompressed_size + hdr.chunk_size - 1) / hdr.chunk_size)
+    goto corrupt;
+  if (data_size < chunk_table_size (hdr.n_chunks))
+    goto corrupt;
+
+  self->chunk_size = hdr.chunk_size;
+  self->n_chunks = hdr.n_chunks;
+  self->offsets = g_new (uint64_t, hdr.n_chunks + 1);
+  memcpy (self->offsets, (const uint8_t *) data + sizeof (hdr), (hdr.n_chunks + 1) * sizeof (uint64_t));
+
+  if (self->offsets[0] < chunk_table_size (hdr.n_chunks) ||
+      self->offsets[hdr.n_chunks] != packed_size) {
+    chunk_table_dispose (self);
+    goto corrupt;
+  }
+
+  for (i = 0; i < hdr.n_chunks; i++) {
+    if (self->offsets[i] > self->offsets[i + 1]) {
+      chunk_table_dispose (self);
+      goto corrupt;
+    }
+  }
+
+  return TRUE;
+
+ corrupt:
+  g_set_error_literal (error, EOS_SHARD_ERROR, EOS_SHARD_ERROR_SHARD_FILE_CORRUPT,
+                       "Corrupt chunk table");
+  return FALSE;
+}
+
+/* The number of uncompressed bytes in chunk @idx. */
+gsize
+chunk_table_chunk_length (struct chunk_table *self, uint64_t uncompressed_size, uint32_t idx)
+{
+  uint64_t start = (uint64_t) idx * self->chunk_size;
+  return MIN (self->chunk_size, uncompressed_size - start);
+}
+
+void
+chunk_table_dispose (struct chunk_table *self)
+{
+  g_clear_pointer (&self->offsets, g_free);
+}
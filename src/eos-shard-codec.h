@@ -0,0 +1,91 @@
+/* Copyright 2015 Endless Mobile, Inc. */
+
+/* This file is part of eos-shard.
+ *
+ * eos-shard is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * eos-shard is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with eos-shard.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+/* GI doesn't like the unprefixed codec types. */
+#ifndef __GI_SCANNER__
+
+#include <stdint.h>
+#include <gio/gio.h>
+#include <zstd.h>
+
+#include "eos-shard-blob.h"
+
+/* One-shot encoding and decoding of whole buffers, in the compression
+ * format named by a blob's flags. Blobs without a compression flag are
+ * stored as-is. For zstd, the dictionary arguments are optional; when
+ * encoding against a dictionary, zstd_level is ignored. */
+
+GBytes * codec_encode (EosShardBlobFlags   flags,
+                       int                 zstd_level,
+                       const ZSTD_CDict   *cdict,
+                       const void         *src,
+                       gsize               src_size,
+                       GError            **error);
+
+gboolean codec_decode_into (EosShardBlobFlags   flags,
+                            const ZSTD_DDict   *ddict,
+                            const void         *src,
+                            gsize               src_size,
+                            void               *dst,
+                            gsize               dst_size,
+                            GError            **error);
+
+/* Chunked blobs
+ *
+ * A blob with %EOS_SHARD_BLOB_FLAG_CHUNKED is split into fixed-size chunks
+ * of uncompressed data, each compressed on its own, so that any part of
+ * the content can be decoded without starting from the beginning. The
+ * packed data starts with a chunk table: the header below, followed by
+ * n_chunks + 1 uint64_t offsets, relative to the start of the packed data.
+ * Chunk i spans from offset i to offset i + 1, and the last offset is the
+ * end of the packed data. Every chunk but the last holds chunk_size bytes
+ * of uncompressed data. */
+
+#define CHUNKED_BLOB_CHUNK_SIZE (64 * 1024)
+
+#pragma pack(push, 4)
+
+struct chunk_table_header {
+  uint32_t chunk_size;
+  uint32_t n_chunks;
+};
+
+#pragma pack(pop)
+
+struct chunk_table {
+  uint32_t chunk_size;
+  uint32_t n_chunks;
+  uint64_t *offsets;
+};
+
+gsize chunk_table_size (uint32_t n_chunks);
+void chunk_table_write (void *dst, uint32_t chunk_size, uint32_t n_chunks, const uint64_t *offsets);
+
+gboolean chunk_table_init (struct chunk_table  *self,
+                           const void          *data,
+                           gsize                data_size,
+                           uint64_t             packed_size,
+                           uint64_t             uncompressed_size,
+                           GError             **error);
+gsize chunk_table_chunk_length (struct chunk_table *self, uint64_t uncompressed_size, uint32_t idx);
+void chunk_table_dispose (struct chunk_table *self);
+
+#endif /* __GI_SCANNER__ */
@@ -39,6 +39,12 @@ typedef struct _EosShardDictionary {
   goffset offset;
   struct dictionary_header header;
 
+  /* The block table and a copy of each block's first key, loaded when the
+   * dictionary is opened so that finding a block doesn't touch the disk. */
+  uint16_t n_blocks;
+  struct dictionary_block_table_entry *blocks;
+  char **block_first_keys;
+
   struct bloom_filter _bloom_filter, *bloom_filter;
 } EosShardDictionary;
 
@@ -53,55 +59,75 @@ dictionary_open (struct dictionary_header *header, int fd, goffset offset)
   return TRUE;
 }
 
-/* Find the block for a given key with a binary search. */
-static gboolean
-dictionary_find_block (EosShardDictionary *dictionary,
-                       const char *key,
-                       struct dictionary_block_table_entry *block_out,
-                       GError **error)
+/* Most keys are short, so try a small read before a full-sized one. */
+#define FIRST_KEY_READ_SIZE 256
+
+static char *
+read_block_first_key (EosShardDictionary *dictionary, uint64_t block_offs)
 {
-  ssize_t len;
   int fd = dictionary->fd;
+  char chunk[DICTIONARY_MAX_KEY_SIZE] = {};
+  ssize_t len;
 
-  int key_size = CSTRING_SIZE (key);
-
-  struct dictionary_block_table tbl;
-  len = pread (fd, &tbl, sizeof(tbl), dictionary->offset + dictionary->header.block_table_start);
+  len = pread (fd, chunk, FIRST_KEY_READ_SIZE, dictionary->offset + block_offs);
+  if (len < 0)
+    return NULL;
 
-  if (len < 0) {
-    g_set_error (error, EOS_SHARD_ERROR, EOS_SHARD_ERROR_DICTIONARY_CORRUPT,
-                 "The dictionary is corrupt.");
-    return FALSE;
+  if (memchr (chunk, '\0', len) == NULL) {
+    len = pread (fd, chunk, sizeof (chunk) - 1, dictionary->offset + block_offs);
+    if (len < 0)
+      return NULL;
   }
 
-  struct dictionary_block_table_entry blocks[tbl.n_blocks];
-  len = pread (fd, blocks, sizeof(blocks), dictionary->offset + dictionary->header.block_table_start + 2);
+  return g_strdup (chunk);
+}
 
-  if (len < 0) {
-    g_set_error (error, EOS_SHARD_ERROR, EOS_SHARD_ERROR_DICTIONARY_CORRUPT,
-                 "The dictionary is corrupt.");
-    return FALSE;
+static gboolean
+dictionary_load_blocks (EosShardDictionary *dictionary, GError **error)
+{
+  int fd = dictionary->fd;
+  goffset tbl_offs = dictionary->offset + dictionary->header.block_table_start;
+  uint16_t n_blocks;
+  int i;
+
+  /* The block table is a uint16_t count, immediately followed by the entries. */
+  if (pread (fd, &n_blocks, sizeof (n_blocks), tbl_offs) != sizeof (n_blocks))
+    goto error;
+
+  dictionary->n_blocks = n_blocks;
+  dictionary->blocks = g_new0 (struct dictionary_block_table_entry, n_blocks);
+  dictionary->block_first_keys = g_new0 (char *, n_blocks + 1);
+
+  ssize_t blocks_size = n_blocks * sizeof (*dictionary->blocks);
+  if (pread (fd, dictionary->blocks, blocks_size, tbl_offs + sizeof (n_blocks)) != blocks_size)
+    goto error;
+
+  for (i = 0; i < n_blocks; i++) {
+    dictionary->block_first_keys[i] = read_block_first_key (dictionary, dictionary->blocks[i].offset);
+    if (dictionary->block_first_keys[i] == NULL)
+      goto error;
   }
 
-  /* bsearch */
-  int lo = 0, hi = tbl.n_blocks - 1;
-  while (lo <= hi) {
-    int mid = (lo + hi) / 2;
-    uint64_t block_offs = blocks[mid].offset;
+  return TRUE;
 
-    char chunk_key[key_size];
-    memset (chunk_key, 0, key_size);
-    len = pread (fd, chunk_key, key_size, dictionary->offset + block_offs);
+ error:
+  g_set_error (error, EOS_SHARD_ERROR, EOS_SHARD_ERROR_DICTIONARY_CORRUPT,
+               "The dictionary is corrupt.");
+  return FALSE;
+}
 
-    if (len < 0) {
-      g_set_error (error, EOS_SHARD_ERROR, EOS_SHARD_ERROR_DICTIONARY_CORRUPT,
-                   "The dictionary is corrupt.");
-      return FALSE;
-    }
+/* Find the index of the block that may contain a given key with a binary
+ * search over the blocks' first keys. Returns -1 if there's no such block. */
+static int
+dictionary_find_block (EosShardDictionary *dictionary, const char *key)
+{
+  int lo = 0, hi = dictionary->n_blocks - 1;
+  while (lo <= hi) {
+    int mid = (lo + hi) / 2;
 
-    /* We want to find the first block where the chunk_key is greater than the key,
+    /* We want to find the first block where the first key is greater than the key,
      * since the block before that has the value we want. */
-    int p = (strncmp (chunk_key, key, key_size) > 0);
+    int p = (strcmp (dictionary->block_first_keys[mid], key) > 0);
 
     if (p)
       hi = mid - 1;
@@ -110,12 +136,10 @@ dictionary_find_block (EosShardDictionary *dictionary,
   }
 
   /* We didn't find the item. */
-  if (lo <= 0 || hi > tbl.n_blocks - 1)
-    return FALSE;
+  if (lo <= 0 || hi > dictionary->n_blocks - 1)
+    return -1;
 
-  uint64_t block_idx = lo - 1;
-  *block_out = blocks[block_idx];
-  return TRUE;
+  return lo - 1;
 }
 
 /* Given a block, do the linear scan into it. */
@@ -177,12 +201,22 @@ dictionary_lookup_key (EosShardDictionary *dictionary, const char *key, GError *
     if (!bloom_filter_test (dictionary->bloom_filter, key))
       return 0;
 
-  struct dictionary_block_table_entry block;
-
-  if (!dictionary_find_block (dictionary, key, &block, error))
+  int block_idx = dictionary_find_block (dictionary, key);
+  if (block_idx < 0)
     return 0;
 
-  return dictionary_lookup_key_in_block (dictionary, block, key, error);
+  return dictionary_lookup_key_in_block (dictionary, dictionary->blocks[block_idx], key, error);
+}
+
+static void
+eos_shard_dictionary_free (EosShardDictionary *dictionary)
+{
+  if (dictionary->bloom_filter)
+    bloom_filter_dispose (dictionary->bloom_filter);
+
+  g_free (dictionary->blocks);
+  g_strfreev (dictionary->block_first_keys);
+  g_free (dictionary);
 }
 
 EosShardDictionary *
@@ -202,24 +236,22 @@ eos_shard_dictionary_new_for_fd (int fd, goffset offset, GError **error)
   dictionary->offset = offset;
   dictionary->header = header;
 
+  if (!dictionary_load_blocks (dictionary, error)) {
+    eos_shard_dictionary_free (dictionary);
+    return NULL;
+  }
+
   if (dictionary->header.bloom_filter_start != 0) {
     dictionary->bloom_filter = &dictionary->_bloom_filter;
-    if (!bloom_filter_init_for_fd (dictionary->bloom_filter, fd, offset + dictionary->header.bloom_filter_start, error))
+    if (!bloom_filter_init_for_fd (dictionary->bloom_filter, fd, offset + dictionary->header.bloom_filter_start, error)) {
+      eos_shard_dictionary_free (dictionary);
       return NULL;
+    }
   }
 
   return dictionary;
 }
 
-static void
-eos_shard_dictionary_free (EosShardDictionary *dictionary)
-{
-  if (dictionary->bloom_filter)
-    bloom_filter_dispose (dictionary->bloom_filter);
-
-  g_free (dictionary);
-}
-
 EosShardDictionary *
 eos_shard_dictionary_ref (EosShardDictionary *dictionary)
 {
@@ -261,5 +293,338 @@ eos_shard_dictionary_lookup_key (EosShardDictionary *dictionary, const char *key
   return read_cstring (dictionary->fd, dictionary->offset + value_offset);
 }
 
+/* Reads the whole of a block into memory. The buffer is NUL-terminated
+ * past the end of the block, so strings in it can be scanned safely. */
+static char *
+dictionary_read_block (EosShardDictionary *dictionary, int block_idx, gsize *len_out, GError **error)
+{
+  struct dictionary_block_table_entry *block = &dictionary->blocks[block_idx];
+  char *buf = g_malloc (block->length + 1);
+
+  ssize_t len = pread (dictionary->fd, buf, block->length, dictionary->offset + block->offset);
+  if (len < 0 || len != block->length) {
+    g_free (buf);
+    g_set_error (error, EOS_SHARD_ERROR, EOS_SHARD_ERROR_DICTIONARY_CORRUPT,
+                 "The dictionary is corrupt.");
+    return NULL;
+  }
+
+  buf[block->length] = '\0';
+  *len_out = block->length;
+  return buf;
+}
+
+static gint
+compare_keys (gconstpointer a, gconstpointer b)
+{
+  return strcmp (* (const char **) a, * (const char **) b);
+}
+
+/**
+ * eos_shard_dictionary_lookup_keys:
+ * @dictionary: the dictionary
+ * @keys: (array zero-terminated=1): the keys to look up
+ * @error: return location for a #GError, or %NULL
+ *
+ * Looks up many keys at once. The keys are sorted and resolved in a single
+ * ordered walk over the dictionary's blocks, so each block is read at most
+ * once no matter how many of the keys fall into it.
+ *
+ * Returns: (transfer full) (element-type utf8 utf8): a table mapping each
+ *   key that was found to its value
+ */
+GHashTable *
+eos_shard_dictionary_lookup_keys (EosShardDictionary *dictionary, const char **keys, GError **error)
+{
+  g_autoptr(GPtrArray) sorted_keys = g_ptr_array_new ();
+  const char **k;
+  int i;
+
+  for (k = keys; *k != NULL; k++) {
+    if (dictionary->bloom_filter)
+      if (!bloom_filter_test (dictionary->bloom_filter, *k))
+        continue;
+
+    g_ptr_array_add (sorted_keys, (gpointer) *k);
+  }
+
+  g_ptr_array_sort (sorted_keys, compare_keys);
+
+  g_autoptr(GHashTable) values = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  g_autofree char *block = NULL;
+  gsize block_len = 0;
+  int block_idx = -1;
+  const char *str = NULL;
+
+  for (i = 0; i < sorted_keys->len; i++) {
+    const char *key = g_ptr_array_index (sorted_keys, i);
+
+    /* Since the keys are sorted, this only ever moves forward. */
+    int key_block_idx = dictionary_find_block (dictionary, key);
+    if (key_block_idx < 0)
+      continue;
+
+    if (key_block_idx != block_idx) {
+      g_free (block);
+      block = dictionary_read_block (dictionary, key_block_idx, &block_len, error);
+      if (block == NULL)
+        return NULL;
+
+      block_idx = key_block_idx;
+      str = block;
+    }
+
+    /* Resume the linear scan from where the previous key left off. */
+    const char *end = block + block_len;
+    while (str < end) {
+      const char *entry_key = str;
+      const char *value = entry_key + CSTRING_SIZE (entry_key);
+      if (value >= end) {
+        str = end;
+        break;
+      }
+
+      int cmp = strcmp (entry_key, key);
+
+      /* We've gone past where the key would be, so it isn't here. */
+      if (cmp > 0)
+        break;
+
+      str = value + CSTRING_SIZE (value);
+
+      if (cmp == 0) {
+        g_hash_table_insert (values, g_strdup (key), g_strdup (value));
+        break;
+      }
+    }
+  }
+
+  return g_steal_pointer (&values);
+}
+
 G_DEFINE_BOXED_TYPE (EosShardDictionary, eos_shard_dictionary,
                      eos_shard_dictionary_ref, eos_shard_dictionary_unref)
+
+struct _EosShardDictionaryIter {
+  int ref_count;
+  EosShardDictionary *dictionary;
+
+  /* The range of keys to iterate over. The end key is exclusive, and
+   * either may be NULL for an open range. */
+  char *start_key;
+  char *end_key;
+
+  /* If set by a seek, only keys starting with this are returned. */
+  char *prefix;
+
+  gboolean positioned;
+
+  /* The block we're currently walking over, or NULL when we're done. */
+  int block_idx;
+  char *block;
+  gsize block_len;
+
+  /* The next entry in the block. */
+  const char *str;
+};
+
+/**
+ * eos_shard_dictionary_iter_new:
+ * @dictionary: the dictionary
+ * @start_key: (allow-none): the first key to return, or %NULL to start
+ *   from the beginning
+ * @end_key: (allow-none): the key to stop before, or %NULL to run to the end
+ *
+ * Creates an iterator over the entries of @dictionary whose keys are in the
+ * range [@start_key, @end_key), in sorted order.
+ *
+ * Returns: (transfer full): a new iterator
+ */
+EosShardDictionaryIter *
+eos_shard_dictionary_iter_new (EosShardDictionary *dictionary,
+                               const char *start_key,
+                               const char *end_key)
+{
+  EosShardDictionaryIter *iter = g_new0 (EosShardDictionaryIter, 1);
+  iter->ref_count = 1;
+  iter->dictionary = eos_shard_dictionary_ref (dictionary);
+  iter->start_key = g_strdup (start_key);
+  iter->end_key = g_strdup (end_key);
+  iter->block_idx = -1;
+  return iter;
+}
+
+static void
+eos_shard_dictionary_iter_free (EosShardDictionaryIter *iter)
+{
+  eos_shard_dictionary_unref (iter->dictionary);
+  g_free (iter->start_key);
+  g_free (iter->end_key);
+  g_free (iter->prefix);
+  g_free (iter->block);
+  g_free (iter);
+}
+
+EosShardDictionaryIter *
+eos_shard_dictionary_iter_ref (EosShardDictionaryIter *iter)
+{
+  iter->ref_count++;
+  return iter;
+}
+
+void
+eos_shard_dictionary_iter_unref (EosShardDictionaryIter *iter)
+{
+  if (--iter->ref_count == 0)
+    eos_shard_dictionary_iter_free (iter);
+}
+
+static gboolean
+iter_load_block (EosShardDictionaryIter *iter, int block_idx, GError **error)
+{
+  g_clear_pointer (&iter->block, g_free);
+  iter->block_idx = block_idx;
+  iter->str = NULL;
+
+  /* We've walked off the end of the dictionary. */
+  if (block_idx >= iter->dictionary->n_blocks)
+    return TRUE;
+
+  iter->block = dictionary_read_block (iter->dictionary, block_idx, &iter->block_len, error);
+  if (iter->block == NULL)
+    return FALSE;
+
+  iter->str = iter->block;
+  return TRUE;
+}
+
+/* Positions the iterator on the first entry whose key is >= @key. */
+static gboolean
+iter_position (EosShardDictionaryIter *iter, const char *key, GError **error)
+{
+  int block_idx = 0;
+
+  if (key != NULL) {
+    block_idx = dictionary_find_block (iter->dictionary, key);
+
+    /* If the key sorts before every block, start from the beginning. */
+    if (block_idx < 0)
+      block_idx = 0;
+  }
+
+  iter->positioned = TRUE;
+  if (!iter_load_block (iter, block_idx, error))
+    return FALSE;
+
+  if (key == NULL || iter->block == NULL)
+    return TRUE;
+
+  /* Skip over the entries in the block that come before the key. If we
+   * run off the end, the key is at the start of the next block, which is
+   * where next() will carry on from. */
+  const char *end = iter->block + iter->block_len;
+  while (iter->str < end) {
+    const char *entry_key = iter->str;
+    if (strcmp (entry_key, key) >= 0)
+      break;
+
+    const char *value = entry_key + CSTRING_SIZE (entry_key);
+    if (value >= end) {
+      iter->str = end;
+      break;
+    }
+
+    iter->str = value + CSTRING_SIZE (value);
+  }
+
+  return TRUE;
+}
+
+/**
+ * eos_shard_dictionary_iter_seek:
+ * @iter: the iterator
+ * @prefix: the prefix to seek to
+ * @error: return location for a #GError, or %NULL
+ *
+ * Moves @iter to the first key starting with @prefix, and restricts it to
+ * only return keys with that prefix from then on. The iterator's range
+ * still applies.
+ *
+ * Returns: %TRUE on success
+ */
+gboolean
+eos_shard_dictionary_iter_seek (EosShardDictionaryIter *iter,
+                                const char *prefix,
+                                GError **error)
+{
+  g_free (iter->prefix);
+  iter->prefix = g_strdup (prefix);
+
+  const char *key = prefix;
+  if (iter->start_key != NULL && strcmp (iter->start_key, prefix) > 0)
+    key = iter->start_key;
+
+  return iter_position (iter, key, error);
+}
+
+/**
+ * eos_shard_dictionary_iter_next:
+ * @iter: the iterator
+ * @key: (out) (transfer none) (optional): return location for the key
+ * @value: (out) (transfer none) (optional): return location for the value
+ * @error: return location for a #GError, or %NULL
+ *
+ * Advances @iter to the next entry. The returned strings point into the
+ * iterator's buffer rather than being copied, and are only valid until
+ * the next call on @iter.
+ *
+ * Returns: %TRUE if an entry was returned, %FALSE at the end of the range
+ *   or on error
+ */
+gboolean
+eos_shard_dictionary_iter_next (EosShardDictionaryIter *iter,
+                                const char **key,
+                                const char **value,
+                                GError **error)
+{
+  if (!iter->positioned)
+    if (!iter_position (iter, iter->start_key, error))
+      return FALSE;
+
+  while (iter->block != NULL) {
+    const char *end = iter->block + iter->block_len;
+
+    if (iter->str >= end) {
+      if (!iter_load_block (iter, iter->block_idx + 1, error))
+        return FALSE;
+      continue;
+    }
+
+    const char *entry_key = iter->str;
+    const char *entry_value = entry_key + CSTRING_SIZE (entry_key);
+    if (entry_value >= end) {
+      iter->str = end;
+      continue;
+    }
+
+    /* Keys are sorted, so the first one out of range means we're done. */
+    if ((iter->end_key != NULL && strcmp (entry_key, iter->end_key) >= 0) ||
+        (iter->prefix != NULL && !g_str_has_prefix (entry_key, iter->prefix))) {
+      g_clear_pointer (&iter->block, g_free);
+      break;
+    }
+
+    iter->str = entry_value + CSTRING_SIZE (entry_value);
+
+    if (key)
+      *key = entry_key;
+    if (value)
+      *value = entry_value;
+    return TRUE;
+  }
+
+  return FALSE;
+}
+
+G_DEFINE_BOXED_TYPE (EosShardDictionaryIter, eos_shard_dictionary_iter,
+                     eos_shard_dictionary_iter_ref, eos_shard_dictionary_iter_unref)
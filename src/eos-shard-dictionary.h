@@ -34,3 +34,21 @@ void eos_shard_dictionary_unref (EosShardDictionary *dictionary);
 char * eos_shard_dictionary_lookup_key (EosShardDictionary *dictionary,
                                         const char *key,
                                         GError **error);
+GHashTable * eos_shard_dictionary_lookup_keys (EosShardDictionary *dictionary,
+                                               const char **keys,
+                                               GError **error);
+
+GType eos_shard_dictionary_iter_get_type (void) G_GNUC_CONST;
+
+EosShardDictionaryIter * eos_shard_dictionary_iter_new (EosShardDictionary *dictionary,
+                                                        const char *start_key,
+                                                        const char *end_key);
+EosShardDictionaryIter * eos_shard_dictionary_iter_ref (EosShardDictionaryIter *iter);
+void eos_shard_dictionary_iter_unref (EosShardDictionaryIter *iter);
+gboolean eos_shard_dictionary_iter_seek (EosShardDictionaryIter *iter,
+                                         const char *prefix,
+                                         GError **error);
+gboolean eos_shard_dictionary_iter_next (EosShardDictionaryIter *iter,
+                                         const char **key,
+                                         const char **value,
+                                         GError **error);
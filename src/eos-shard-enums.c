@@ -35,3 +35,9 @@ EOS_SHARD_DEFINE_ENUM_TYPE (EosShardError, eos_shard_error,
   EOS_SHARD_DEFINE_ENUM_VALUE (EOS_SHARD_ERROR_DICTIONARY_WRITER_WRONG_NUMBER_ENTRIES, "dictionary-writer-wrong-number-entries")
   EOS_SHARD_DEFINE_ENUM_VALUE (EOS_SHARD_ERROR_DICTIONARY_WRITER_ENTRIES_OUT_OF_ORDER, "dictionary-writer-entries-out-of-order")
   EOS_SHARD_DEFINE_ENUM_VALUE (EOS_SHARD_ERROR_LAST, "type-last"))
+
+EOS_SHARD_DEFINE_ENUM_TYPE (EosShardChecksumPolicy, eos_shard_checksum_policy,
+  EOS_SHARD_DEFINE_ENUM_VALUE (EOS_SHARD_CHECKSUM_POLICY_ALWAYS, "always")
+  EOS_SHARD_DEFINE_ENUM_VALUE (EOS_SHARD_CHECKSUM_POLICY_ONCE, "once")
+  EOS_SHARD_DEFINE_ENUM_VALUE (EOS_SHARD_CHECKSUM_POLICY_SAMPLED, "sampled")
+  EOS_SHARD_DEFINE_ENUM_VALUE (EOS_SHARD_CHECKSUM_POLICY_NEVER, "never"))
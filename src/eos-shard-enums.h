@@ -44,4 +44,25 @@ typedef enum {
 GType eos_shard_error_get_type (void);
 GQuark eos_shard_error_quark (void);
 
+#define EOS_SHARD_TYPE_CHECKSUM_POLICY             (eos_shard_checksum_policy_get_type ())
+
+/**
+ * EosShardChecksumPolicy:
+ * @EOS_SHARD_CHECKSUM_POLICY_ALWAYS: Verify a blob's checksum every time it is loaded
+ * @EOS_SHARD_CHECKSUM_POLICY_ONCE: Verify each blob the first time it is loaded,
+ *   and trust it from then on
+ * @EOS_SHARD_CHECKSUM_POLICY_SAMPLED: Verify a random sample of blob loads
+ * @EOS_SHARD_CHECKSUM_POLICY_NEVER: Never verify checksums when loading blobs
+ *
+ * How an #EosShardShardFile verifies blob checksums.
+ */
+typedef enum {
+  EOS_SHARD_CHECKSUM_POLICY_ALWAYS,
+  EOS_SHARD_CHECKSUM_POLICY_ONCE,
+  EOS_SHARD_CHECKSUM_POLICY_SAMPLED,
+  EOS_SHARD_CHECKSUM_POLICY_NEVER,
+} EosShardChecksumPolicy;
+
+GType eos_shard_checksum_policy_get_type (void);
+
 #endif /* __EOS_SHARD_ENUMS_H__ */
@@ -20,6 +20,7 @@
 #ifndef EOS_SHARD_FORMAT_V2_H
 #define EOS_SHARD_FORMAT_V2_H
 
+#include <stddef.h>
 #include <stdint.h>
 
 #include "eos-shard-shard-file.h"
@@ -45,8 +46,8 @@
 struct eos_shard_v2_hdr {
   char magic[8];
 
-  /* Flags about the file. If we extend the format to add new chunks,
-   * we might add in cap bits in here. For now, there are no flags. */
+  /* Flags about the file. When we extend the format to add new chunks,
+   * we add in cap bits in here. See the EOS_SHARD_V2_HDR_FLAG enum. */
   uint16_t flags;
 
   /* Number of all records in the shard. */
@@ -58,6 +59,35 @@ struct eos_shard_v2_hdr {
   /* Offset to the string constant table. All other offsets into the
    * string constant table are relative to this... */
   uint64_t string_constant_table_start;
+
+  /* Fields below were added after the initial version of the format.
+   * Older shards have a shorter header, so each field is only valid if
+   * the matching flag is set. */
+
+  /* With EOS_SHARD_V2_HDR_FLAG_ZSTD_DICTIONARY, the location of a zstd
+   * dictionary shared by blobs with EOS_SHARD_V2_BLOB_FLAG_ZSTD_DICTIONARY. */
+  uint64_t zstd_dictionary_start;
+  uint64_t zstd_dictionary_size;
+
+  /* With EOS_SHARD_V2_HDR_FLAG_RECORD_FILTER, the location of a bloom
+   * filter over the raw names of all records, tombstones included. Lookups
+   * for names not in the filter can skip searching the record table.
+   *
+   * The filter is a struct bloom_filter_header (n_bits, n_buckets and
+   * n_hashes, as 32-bit words) followed by n_buckets 32-bit buckets, with
+   * n_bits == n_buckets * 32. The buckets are split into 64-byte blocks of
+   * 16 buckets each, and every name sets n_hashes bits within a single
+   * block; see eos-shard-bloom-filter.c for how they are chosen. */
+  uint64_t record_filter_start;
+  uint64_t record_filter_size;
+};
+
+/* The size of the header before any optional fields were added. */
+#define EOS_SHARD_V2_HDR_MIN_SIZE (offsetof (struct eos_shard_v2_hdr, zstd_dictionary_start))
+
+enum {
+  EOS_SHARD_V2_HDR_FLAG_ZSTD_DICTIONARY = 0x01,
+  EOS_SHARD_V2_HDR_FLAG_RECORD_FILTER   = 0x02,
 };
 
 enum {
@@ -96,6 +126,13 @@ struct eos_shard_v2_record_blob_table_entry {
 #define EOS_SHARD_V2_BLOB_MAX_NAME_SIZE (255)
 #define EOS_SHARD_V2_BLOB_MAX_CONTENT_TYPE_SIZE (255)
 
+/* Private blob flags, stored alongside the public EosShardBlobFlags. These
+ * start high, to leave room for more public flags. */
+enum {
+  /* The blob is zstd-compressed against the shard's zstd dictionary. */
+  EOS_SHARD_V2_BLOB_FLAG_ZSTD_DICTIONARY = 0x100,
+};
+
 struct eos_shard_v2_blob {
   /* Flags and capability bits, along with the public EosShardBlobFlags... */
   uint16_t flags;
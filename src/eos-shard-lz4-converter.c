@@ -0,0 +1,171 @@
+/* Copyright 2015 Endless Mobile, Inc. */
+
+/* This file is part of eos-shard.
+ *
+ * eos-shard is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * eos-shard is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with eos-shard.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "eos-shard-lz4-converter.h"
+
+#include <string.h>
+
+#include "eos-shard-codec.h"
+
+struct _EosShardLz4Converter
+{
+  GObject parent;
+
+  gboolean compress;
+  gsize uncompressed_size;
+
+  /* All of the input seen so far. */
+  GByteArray *input;
+  /* Once the input is complete, the converted data, and how much of it
+   * has been handed out. */
+  GBytes *output;
+  gsize output_pos;
+};
+
+static void converter_iface_init (GConverterIface *iface);
+
+G_DEFINE_TYPE_WITH_CODE (EosShardLz4Converter, eos_shard_lz4_converter, G_TYPE_OBJECT,
+                         G_IMPLEMENT_INTERFACE (G_TYPE_CONVERTER, converter_iface_init));
+
+static GBytes *
+lz4_decompress (const uint8_t *data, gsize size, gsize uncompressed_size, GError **error)
+{
+  uint8_t *buf = g_malloc (uncompressed_size);
+
+  if (!codec_decode_into (EOS_SHARD_BLOB_FLAG_COMPRESSED_LZ4, NULL, data, size, buf, uncompressed_size, error)) {
+    g_free (buf);
+    return NULL;
+  }
+
+  return g_bytes_new_take (buf, uncompressed_size);
+}
+
+static GConverterResult
+eos_shard_lz4_converter_convert (GConverter *converter,
+                                 const void *inbuf,
+                                 gsize inbuf_size,
+                                 void *outbuf,
+                                 gsize outbuf_size,
+                                 GConverterFlags flags,
+                                 gsize *bytes_read,
+                                 gsize *bytes_written,
+                                 GError **error)
+{
+  EosShardLz4Converter *self = EOS_SHARD_LZ4_CONVERTER (converter);
+
+  *bytes_read = 0;
+  *bytes_written = 0;
+
+  if (self->output == NULL) {
+    g_byte_array_append (self->input, inbuf, inbuf_size);
+    *bytes_read = inbuf_size;
+
+    if (!(flags & G_CONVERTER_INPUT_AT_END))
+      return G_CONVERTER_CONVERTED;
+
+    if (self->compress)
+      self->output = codec_encode (EOS_SHARD_BLOB_FLAG_COMPRESSED_LZ4, 0, NULL, self->input->data, self->input->len, error);
+    else
+      self->output = lz4_decompress (self->input->data, self->input->len, self->uncompressed_size, error);
+
+    if (self->output == NULL)
+      return G_CONVERTER_ERROR;
+
+    g_byte_array_set_size (self->input, 0);
+  }
+
+  gsize output_size;
+  const uint8_t *output = g_bytes_get_data (self->output, &output_size);
+  gsize count = MIN (outbuf_size, output_size - self->output_pos);
+
+  if (count == 0 && self->output_pos < output_size) {
+    g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_NO_SPACE,
+                         "Not enough space in destination");
+    return G_CONVERTER_ERROR;
+  }
+
+  memcpy (outbuf, output + self->output_pos, count);
+  self->output_pos += count;
+  *bytes_written = count;
+
+  if (self->output_pos == output_size)
+    return G_CONVERTER_FINISHED;
+  else
+    return G_CONVERTER_CONVERTED;
+}
+
+static void
+eos_shard_lz4_converter_reset (GConverter *converter)
+{
+  EosShardLz4Converter *self = EOS_SHARD_LZ4_CONVERTER (converter);
+
+  g_byte_array_set_size (self->input, 0);
+  g_clear_pointer (&self->output, g_bytes_unref);
+  self->output_pos = 0;
+}
+
+static void
+converter_iface_init (GConverterIface *iface)
+{
+  iface->convert = eos_shard_lz4_converter_convert;
+  iface->reset = eos_shard_lz4_converter_reset;
+}
+
+static void
+eos_shard_lz4_converter_finalize (GObject *object)
+{
+  EosShardLz4Converter *self = EOS_SHARD_LZ4_CONVERTER (object);
+
+  g_byte_array_unref (self->input);
+  g_clear_pointer (&self->output, g_bytes_unref);
+
+  G_OBJECT_CLASS (eos_shard_lz4_converter_parent_class)->finalize (object);
+}
+
+static void
+eos_shard_lz4_converter_class_init (EosShardLz4ConverterClass *klass)
+{
+  GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
+
+  gobject_class->finalize = eos_shard_lz4_converter_finalize;
+}
+
+static void
+eos_shard_lz4_converter_init (EosShardLz4Converter *self)
+{
+  self->input = g_byte_array_new ();
+}
+
+EosShardLz4Converter *
+_eos_shard_lz4_converter_new_compressor (void)
+{
+  EosShardLz4Converter *self = g_object_new (EOS_SHARD_TYPE_LZ4_CONVERTER, NULL);
+  self->compress = TRUE;
+  return self;
+}
+
+EosShardLz4Converter *
+_eos_shard_lz4_converter_new_decompressor (gsize uncompressed_size)
+{
+  EosShardLz4Converter *self = g_object_new (EOS_SHARD_TYPE_LZ4_CONVERTER, NULL);
+  self->uncompressed_size = uncompressed_size;
+  return self;
+}
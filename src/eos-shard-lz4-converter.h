@@ -0,0 +1,39 @@
+/* Copyright 2015 Endless Mobile, Inc. */
+
+/* This file is part of eos-shard.
+ *
+ * eos-shard is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * eos-shard is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with eos-shard.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <gio/gio.h>
+
+#include "eos-shard-types.h"
+
+/**
+ * EosShardLz4Converter:
+ *
+ * A #GConverter that compresses or decompresses a single raw LZ4 block,
+ * used for blobs with %EOS_SHARD_BLOB_FLAG_COMPRESSED_LZ4. Since an LZ4
+ * block can only be handled as a whole, the converter buffers all of its
+ * input before producing any output.
+ */
+
+#define EOS_SHARD_TYPE_LZ4_CONVERTER (eos_shard_lz4_converter_get_type ())
+G_DECLARE_FINAL_TYPE (EosShardLz4Converter, eos_shard_lz4_converter, EOS_SHARD, LZ4_CONVERTER, GObject)
+
+EosShardLz4Converter * _eos_shard_lz4_converter_new_compressor (void);
+EosShardLz4Converter * _eos_shard_lz4_converter_new_decompressor (gsize uncompressed_size);
@@ -46,14 +46,14 @@ eos_shard_record_free (EosShardRecord *record)
 EosShardRecord *
 eos_shard_record_ref (EosShardRecord *record)
 {
-  record->ref_count++;
+  g_atomic_int_inc (&record->ref_count);
   return record;
 }
 
 void
 eos_shard_record_unref (EosShardRecord *record)
 {
-  if (--record->ref_count == 0)
+  if (g_atomic_int_dec_and_test (&record->ref_count))
     eos_shard_record_free (record);
 }
 
@@ -102,6 +102,79 @@ eos_shard_record_lookup_blob (EosShardRecord *record,
   return _eos_shard_shard_file_lookup_blob (record->shard_file, record, name);
 }
 
+struct lookup_blob_data
+{
+  EosShardRecord *record;
+  char *name;
+};
+
+static void
+lookup_blob_data_free (struct lookup_blob_data *data)
+{
+  eos_shard_record_unref (data->record);
+  g_free (data->name);
+  g_free (data);
+}
+
+static void
+lookup_blob_thread (GTask        *task,
+                    gpointer      source_object,
+                    gpointer      task_data,
+                    GCancellable *cancellable)
+{
+  struct lookup_blob_data *data = task_data;
+  EosShardBlob *blob = eos_shard_record_lookup_blob (data->record, data->name);
+  g_task_return_pointer (task, blob, (GDestroyNotify) eos_shard_blob_unref);
+}
+
+/**
+ * eos_shard_record_lookup_blob_async:
+ * @record: An #EosShardRecord
+ * @name: The name to look up the blob by.
+ * @cancellable: (allow-none): a #GCancellable
+ * @callback: the function to call when the lookup is done
+ * @user_data: user data to pass to @callback
+ *
+ * Asynchronous version of eos_shard_record_lookup_blob(), which does the
+ * lookup in a worker thread.
+ */
+void
+eos_shard_record_lookup_blob_async (EosShardRecord      *record,
+                                    const char          *name,
+                                    GCancellable        *cancellable,
+                                    GAsyncReadyCallback  callback,
+                                    gpointer             user_data)
+{
+  struct lookup_blob_data *data = g_new0 (struct lookup_blob_data, 1);
+  data->record = eos_shard_record_ref (record);
+  data->name = g_strdup (name);
+
+  g_autoptr(GTask) task = g_task_new (NULL, cancellable, callback, user_data);
+  g_task_set_source_tag (task, eos_shard_record_lookup_blob_async);
+  g_task_set_task_data (task, data, (GDestroyNotify) lookup_blob_data_free);
+  g_task_run_in_thread (task, lookup_blob_thread);
+}
+
+/**
+ * eos_shard_record_lookup_blob_finish:
+ * @record: An #EosShardRecord
+ * @result: the #GAsyncResult passed to the callback
+ * @error: return location for a #GError
+ *
+ * Returns: (transfer full): the blob, or %NULL if there is no blob with
+ *   the given name
+ */
+EosShardBlob *
+eos_shard_record_lookup_blob_finish (EosShardRecord  *record,
+                                     GAsyncResult    *result,
+                                     GError         **error)
+{
+  g_return_val_if_fail (g_task_is_valid (result, NULL), NULL);
+  g_return_val_if_fail (g_task_get_source_tag (G_TASK (result)) == eos_shard_record_lookup_blob_async, NULL);
+
+  return g_task_propagate_pointer (G_TASK (result), error);
+}
+
 /**
  * eos_shard_record_list_blobs :
  *
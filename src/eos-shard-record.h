@@ -56,6 +56,14 @@ void eos_shard_record_unref (EosShardRecord *record);
 
 EosShardBlob * eos_shard_record_lookup_blob (EosShardRecord *record,
                                              const char     *name);
+void eos_shard_record_lookup_blob_async (EosShardRecord      *record,
+                                         const char          *name,
+                                         GCancellable        *cancellable,
+                                         GAsyncReadyCallback  callback,
+                                         gpointer             user_data);
+EosShardBlob * eos_shard_record_lookup_blob_finish (EosShardRecord  *record,
+                                                    GAsyncResult    *result,
+                                                    GError         **error);
 GSList * eos_shard_record_list_blobs (EosShardRecord *record);
 
 G_DEFINE_AUTOPTR_CLEANUP_FUNC (EosShardRecord, eos_shard_record_unref)
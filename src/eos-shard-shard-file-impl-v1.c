@@ -253,6 +253,35 @@ records_foreach (EosShardShardFileImpl *impl, EosShardRecordsForeachFunc func, g
   }
 }
 
+static guint
+get_n_raw_names (EosShardShardFileImpl *impl)
+{
+  EosShardShardFileImplV1 *self = EOS_SHARD_SHARD_FILE_IMPL_V1 (impl);
+  g_autoptr(GVariant) records = g_variant_get_child_value (self->header_variant, 1);
+  return g_variant_n_children (records);
+}
+
+static const uint8_t *
+get_raw_name (EosShardShardFileImpl *impl, guint idx, gboolean *tombstone)
+{
+  EosShardShardFileImplV1 *self = EOS_SHARD_SHARD_FILE_IMPL_V1 (impl);
+  g_autoptr(GVariant) records = g_variant_get_child_value (self->header_variant, 1);
+  g_autoptr(GVariant) raw_name_variant;
+  size_t n_elts;
+
+  g_variant_get_child (records, idx,
+                       "(@ay@" EOS_SHARD_V1_BLOB_ENTRY "@" EOS_SHARD_V1_BLOB_ENTRY ")",
+                       &raw_name_variant, NULL, NULL);
+
+  /* V1 has no tombstones. The name points into the header data, which we
+   * keep around for as long as we live. */
+  *tombstone = FALSE;
+  const uint8_t *raw_name = g_variant_get_fixed_array (raw_name_variant, &n_elts, 1);
+  if (n_elts != EOS_SHARD_RAW_NAME_SIZE)
+    return NULL;
+  return raw_name;
+}
+
 static EosShardBlob *
 lookup_blob (EosShardShardFileImpl *impl, EosShardRecord *record, const char *name)
 {
@@ -280,4 +309,6 @@ shard_file_impl_init (EosShardShardFileImplInterface *iface)
   iface->lookup_blob = lookup_blob;
   iface->list_blobs = list_blobs;
   iface->records_foreach = records_foreach;
+  iface->get_n_raw_names = get_n_raw_names;
+  iface->get_raw_name = get_raw_name;
 }
@@ -34,6 +34,7 @@
 #include "eos-shard-blob.h"
 #include "eos-shard-record.h"
 
+#include "eos-shard-bloom-filter.h"
 #include "eos-shard-format-v2.h"
 
 struct _EosShardShardFileImplV2
@@ -43,8 +44,20 @@ struct _EosShardShardFileImplV2
   EosShardShardFile *shard_file;
   int fd;
 
+  /* A read-only mapping of the whole file. If the file could not be
+   * mapped, this is NULL and we fall back to pread. */
+  GBytes *map_bytes;
+  const uint8_t *map;
+  gsize map_size;
+
   struct eos_shard_v2_hdr hdr;
+
+  /* Points into the mapping when we have one, otherwise owned by us. */
   struct eos_shard_v2_record *records;
+
+  /* Set if the file has EOS_SHARD_V2_HDR_FLAG_RECORD_FILTER. */
+  gboolean have_record_filter;
+  struct bloom_filter record_filter;
 };
 
 static void shard_file_impl_init (EosShardShardFileImplInterface *iface);
@@ -57,7 +70,11 @@ eos_shard_shard_file_impl_v2_finalize (GObject *object)
 {
   EosShardShardFileImplV2 *self = EOS_SHARD_SHARD_FILE_IMPL_V2 (object);
 
-  g_clear_pointer (&self->records, g_free);
+  if (self->map_bytes == NULL)
+    g_clear_pointer (&self->records, g_free);
+  g_clear_pointer (&self->map_bytes, g_bytes_unref);
+  if (self->have_record_filter)
+    bloom_filter_dispose (&self->record_filter);
 
   G_OBJECT_CLASS (eos_shard_shard_file_impl_v2_parent_class)->finalize (object);
 }
@@ -75,6 +92,65 @@ eos_shard_shard_file_impl_v2_init (EosShardShardFileImplV2 *shard_file)
 {
 }
 
+/* Returns a pointer to @size bytes at file offset @offs. When the file is
+ * mapped, this points straight into the mapping; otherwise the data is
+ * read into @buf. Returns NULL if the range is out of bounds. */
+static const void *
+map_or_read (EosShardShardFileImplV2 *self, void *buf, gsize size, uint64_t offs)
+{
+  if (self->map != NULL) {
+    if (offs > self->map_size || size > self->map_size - offs)
+      return NULL;
+    return self->map + offs;
+  }
+
+  if (pread (self->fd, buf, size, offs) != size)
+    return NULL;
+  return buf;
+}
+
+/* Anything more is surely corruption, and would blow the stack in
+ * bloom_filter_test_digest(). */
+#define RECORD_FILTER_MAX_HASHES 64
+
+static gboolean
+load_record_filter (EosShardShardFileImplV2 *self)
+{
+  struct bloom_filter_header header;
+
+  if (pread (self->fd, &header, sizeof (header), self->hdr.record_filter_start) != sizeof (header))
+    return FALSE;
+
+  if (header.n_buckets % BLOOM_FILTER_BLOCK_BUCKETS != 0 ||
+      header.n_hashes > RECORD_FILTER_MAX_HASHES ||
+      sizeof (header) + (uint64_t) header.n_buckets * sizeof (uint32_t) != self->hdr.record_filter_size)
+    return FALSE;
+
+  if (!bloom_filter_init_for_fd (&self->record_filter, self->fd, self->hdr.record_filter_start, NULL))
+    return FALSE;
+
+  self->have_record_filter = TRUE;
+  return TRUE;
+}
+
+static void
+map_file (EosShardShardFileImplV2 *self)
+{
+  g_autoptr(GError) error = NULL;
+  GMappedFile *mapped_file = g_mapped_file_new_from_fd (self->fd, FALSE, &error);
+
+  /* Not being able to map the file isn't fatal; we just use pread instead. */
+  if (mapped_file == NULL)
+    return;
+
+  self->map_bytes = g_mapped_file_get_bytes (mapped_file);
+  g_mapped_file_unref (mapped_file);
+
+  self->map = g_bytes_get_data (self->map_bytes, &self->map_size);
+  if (self->map == NULL)
+    g_clear_pointer (&self->map_bytes, g_bytes_unref);
+}
+
 EosShardShardFileImpl *
 _eos_shard_shard_file_impl_v2_new (EosShardShardFile *shard_file,
                                    int fd,
@@ -84,16 +160,41 @@ _eos_shard_shard_file_impl_v2_new (EosShardShardFile *shard_file,
   self->fd = fd;
   self->shard_file = shard_file;
 
-  if (read (self->fd, &self->hdr, sizeof (self->hdr)) != sizeof (self->hdr))
+  /* Older shards have a shorter header, so reading the full struct picks
+   * up whatever follows it, if anything. Zero the fields past the end of
+   * the file and those whose flag isn't set, so that only fields the
+   * shard actually has are ever non-zero. */
+  ssize_t hdr_size = pread (self->fd, &self->hdr, sizeof (self->hdr), 0);
+  if (hdr_size < (ssize_t) EOS_SHARD_V2_HDR_MIN_SIZE)
     goto error;
 
+  memset ((uint8_t *) &self->hdr + hdr_size, 0, sizeof (self->hdr) - hdr_size);
+  if (!(self->hdr.flags & EOS_SHARD_V2_HDR_FLAG_ZSTD_DICTIONARY)) {
+    self->hdr.zstd_dictionary_start = 0;
+    self->hdr.zstd_dictionary_size = 0;
+  }
+  if (!(self->hdr.flags & EOS_SHARD_V2_HDR_FLAG_RECORD_FILTER)) {
+    self->hdr.record_filter_start = 0;
+    self->hdr.record_filter_size = 0;
+  }
+
   if (memcmp (self->hdr.magic, EOS_SHARD_V2_MAGIC, sizeof (self->hdr.magic)) != 0)
     goto error;
 
-  int buf_size = self->hdr.records_length * sizeof (*self->records);
-  self->records = g_malloc (buf_size);
+  map_file (self);
+
+  gsize buf_size = self->hdr.records_length * sizeof (*self->records);
+  if (self->map != NULL) {
+    self->records = (struct eos_shard_v2_record *) map_or_read (self, NULL, buf_size, self->hdr.records_start);
+    if (self->records == NULL)
+      goto error;
+  } else {
+    self->records = g_malloc (buf_size);
+    if (pread (self->fd, self->records, buf_size, self->hdr.records_start) != buf_size)
+      goto error;
+  }
 
-  if (pread (self->fd, self->records, buf_size, self->hdr.records_start) != buf_size)
+  if ((self->hdr.flags & EOS_SHARD_V2_HDR_FLAG_RECORD_FILTER) && !load_record_filter (self))
     goto error;
 
   return EOS_SHARD_SHARD_FILE_IMPL (g_steal_pointer (&self));
@@ -104,16 +205,35 @@ _eos_shard_shard_file_impl_v2_new (EosShardShardFile *shard_file,
   return NULL;
 }
 
-static gboolean
-lookup_string_constant (EosShardShardFileImpl *impl, char *buf, int buf_size, uint64_t offs)
+/* Returns the NUL-terminated string at @offs in the string constant table.
+ * When mapped, the returned string points into the mapping; otherwise it
+ * is read into @buf, truncated to @buf_size. */
+static const char *
+lookup_string_constant (EosShardShardFileImplV2 *self, char *buf, int buf_size, uint64_t offs)
 {
-  EosShardShardFileImplV2 *self = EOS_SHARD_SHARD_FILE_IMPL_V2 (impl);
   uint64_t global_offs = self->hdr.string_constant_table_start + offs;
-  return pread (self->fd, buf, buf_size - 1, global_offs) > 0;
+
+  if (self->map != NULL) {
+    if (global_offs >= self->map_size)
+      return NULL;
+
+    const char *str = (const char *) self->map + global_offs;
+    gsize max_len = MIN ((gsize) buf_size, self->map_size - global_offs);
+    if (memchr (str, '\0', max_len) != NULL)
+      return str;
+
+    /* Unterminated within our limit; truncate it like the pread path does. */
+    memcpy (buf, str, MIN (max_len, (gsize) buf_size - 1));
+    return buf;
+  }
+
+  if (pread (self->fd, buf, buf_size - 1, global_offs) <= 0)
+    return NULL;
+  return buf;
 }
 
 static EosShardBlob *
-blob_new (EosShardShardFileImpl *impl, struct eos_shard_v2_blob *sblob)
+blob_new (EosShardShardFileImpl *impl, const struct eos_shard_v2_blob *sblob)
 {
   EosShardShardFileImplV2 *self = EOS_SHARD_SHARD_FILE_IMPL_V2 (impl);
   EosShardShardFile *shard_file = self->shard_file;
@@ -125,58 +245,84 @@ blob_new (EosShardShardFileImpl *impl, struct eos_shard_v2_blob *sblob)
 
   g_autoptr(EosShardBlob) blob = _eos_shard_blob_new ();
   blob->shard_file = g_object_ref (shard_file);
-  blob->flags = sblob->flags;
+  blob->flags = sblob->flags & ~EOS_SHARD_V2_BLOB_FLAG_ZSTD_DICTIONARY;
+  blob->zstd_dictionary = (sblob->flags & EOS_SHARD_V2_BLOB_FLAG_ZSTD_DICTIONARY) != 0;
   memcpy (blob->checksum, sblob->csum, sizeof (blob->checksum));
   blob->size = sblob->size;
   blob->uncompressed_size = sblob->uncompressed_size;
   blob->offs = sblob->data_start;
 
-  char content_type[EOS_SHARD_V2_BLOB_MAX_CONTENT_TYPE_SIZE] = {};
-  if (!lookup_string_constant (impl, content_type, sizeof (content_type), sblob->content_type_offs))
+  char content_type_buf[EOS_SHARD_V2_BLOB_MAX_CONTENT_TYPE_SIZE] = {};
+  const char *content_type = lookup_string_constant (self, content_type_buf, sizeof (content_type_buf), sblob->content_type_offs);
+  if (content_type == NULL)
     return NULL;
 
   blob->content_type = g_strdup (content_type);
+
+  char name_buf[EOS_SHARD_V2_BLOB_MAX_NAME_SIZE + 1] = {};
+  const char *name = lookup_string_constant (self, name_buf, sizeof (name_buf), sblob->name_offs);
+  if (name == NULL)
+    return NULL;
+
+  blob->name = g_strdup (name);
   return g_steal_pointer (&blob);
 }
 
+/* Fetches the blob header for the @i'th entry in @srecord's blob table. */
+static const struct eos_shard_v2_blob *
+get_blob_header (EosShardShardFileImplV2 *self, struct eos_shard_v2_record *srecord, int i,
+                 struct eos_shard_v2_blob *buf)
+{
+  struct eos_shard_v2_record_blob_table_entry entry_buf;
+  const struct eos_shard_v2_record_blob_table_entry *entry;
+
+  entry = map_or_read (self, &entry_buf, sizeof (entry_buf), srecord->blob_table_start + i*sizeof (entry_buf));
+  if (entry == NULL)
+    return NULL;
+
+  return map_or_read (self, buf, sizeof (*buf), entry->blob_start);
+}
+
 static gboolean
+blob_has_name (EosShardShardFileImplV2 *self, const struct eos_shard_v2_blob *blob, const char *name)
+{
+  char entry_name_buf[EOS_SHARD_V2_BLOB_MAX_NAME_SIZE + 1] = {};
+  const char *entry_name = lookup_string_constant (self, entry_name_buf, sizeof (entry_name_buf), blob->name_offs);
+  if (entry_name == NULL)
+    return FALSE;
+
+  return strncmp (entry_name, name, sizeof (entry_name_buf)) == 0;
+}
+
+static const struct eos_shard_v2_blob *
 find_blob (EosShardShardFileImpl *impl, struct eos_shard_v2_record *srecord, const char *name,
-           struct eos_shard_v2_blob *blob_out)
+           struct eos_shard_v2_blob *blob_buf)
 {
   EosShardShardFileImplV2 *self = EOS_SHARD_SHARD_FILE_IMPL_V2 (impl);
   int i;
 
   /* Do a linear search because we don't expect many blobs per record... */
   for (i = 0; i < srecord->blob_table_length; i++) {
-    struct eos_shard_v2_record_blob_table_entry entry;
-    if (pread (self->fd, &entry, sizeof (entry), srecord->blob_table_start + i*sizeof (entry)) != sizeof (entry))
+    const struct eos_shard_v2_blob *blob = get_blob_header (self, srecord, i, blob_buf);
+    if (blob == NULL)
       continue;
 
-    struct eos_shard_v2_blob blob;
-    if (pread (self->fd, &blob, sizeof (blob), entry.blob_start) != sizeof (blob))
-      continue;
-
-    char entry_name[EOS_SHARD_V2_BLOB_MAX_NAME_SIZE + 1] = {};
-    if (!lookup_string_constant (impl, entry_name, sizeof (entry_name), blob.name_offs))
-      continue;
-
-    if (strncmp (entry_name, name, sizeof (entry_name)) == 0) {
-      *blob_out = blob;
-      return TRUE;
-    }
+    if (blob_has_name (self, blob, name))
+      return blob;
   }
 
-  return FALSE;
+  return NULL;
 }
 
 static EosShardBlob *
 read_blob (EosShardShardFileImpl *impl, struct eos_shard_v2_record *srecord, const char *name)
 {
-  struct eos_shard_v2_blob blob;
-  if (!find_blob (impl, srecord, name, &blob))
+  struct eos_shard_v2_blob blob_buf;
+  const struct eos_shard_v2_blob *blob = find_blob (impl, srecord, name, &blob_buf);
+  if (blob == NULL)
     return NULL;
 
-  return blob_new (impl, &blob);
+  return blob_new (impl, blob);
 }
 
 static inline gboolean
@@ -212,14 +358,19 @@ find_record_by_raw_name_compar (const void *a, const void *b)
   return memcmp (rec_a->raw_name, rec_b->raw_name, EOS_SHARD_RAW_NAME_SIZE);
 }
 
-static EosShardRecord *
-find_record_by_raw_name (EosShardShardFileImpl *impl, uint8_t *raw_name)
+/* Finds the live record table entry for @raw_name, if there is one. */
+static struct eos_shard_v2_record *
+lookup_srecord (EosShardShardFileImplV2 *self, const uint8_t *raw_name)
 {
-  EosShardShardFileImplV2 *self = EOS_SHARD_SHARD_FILE_IMPL_V2 (impl);
   struct eos_shard_v2_record key, *res;
 
   memcpy (key.raw_name, raw_name, EOS_SHARD_RAW_NAME_SIZE);
 
+  /* Most lookups in layered deployments are misses; the filter lets us
+   * skip the search for nearly all of them. */
+  if (self->have_record_filter && !bloom_filter_test_digest (&self->record_filter, key.raw_name))
+    return NULL;
+
   res = bsearch (&key, self->records, self->hdr.records_length, sizeof (*self->records),
                  find_record_by_raw_name_compar);
 
@@ -228,9 +379,168 @@ find_record_by_raw_name (EosShardShardFileImpl *impl, uint8_t *raw_name)
   if (record_is_tombstone (res))
     return NULL;
 
+  return res;
+}
+
+static EosShardRecord *
+find_record_by_raw_name (EosShardShardFileImpl *impl, uint8_t *raw_name)
+{
+  EosShardShardFileImplV2 *self = EOS_SHARD_SHARD_FILE_IMPL_V2 (impl);
+  struct eos_shard_v2_record *res = lookup_srecord (self, raw_name);
+
+  if (res == NULL)
+    return NULL;
+
   return record_new (impl, res);
 }
 
+static void
+read_request_clear (struct eos_shard_read_request *request)
+{
+  g_free (request->buf);
+}
+
+/* Picks the blob called @name out of a record's batch-read blob headers. */
+static EosShardBlob *
+blob_new_from_headers (EosShardShardFileImpl *impl, const struct eos_shard_read_request *headers,
+                       guint n_headers, const char *name)
+{
+  EosShardShardFileImplV2 *self = EOS_SHARD_SHARD_FILE_IMPL_V2 (impl);
+  guint i;
+
+  for (i = 0; i < n_headers; i++) {
+    if (headers[i].result != (gssize) headers[i].count)
+      continue;
+
+    if (blob_has_name (self, headers[i].buf, name))
+      return blob_new (impl, headers[i].buf);
+  }
+
+  return NULL;
+}
+
+/* Like record_new(), for a record whose blob headers were read in a
+ * batch. */
+static EosShardRecord *
+record_new_from_headers (EosShardShardFileImpl *impl, struct eos_shard_v2_record *srecord,
+                         const struct eos_shard_read_request *headers, guint n_headers)
+{
+  EosShardShardFileImplV2 *self = EOS_SHARD_SHARD_FILE_IMPL_V2 (impl);
+
+  EosShardRecord *record = _eos_shard_record_new ();
+  record->shard_file = g_object_ref (self->shard_file);
+  record->raw_name = srecord->raw_name;
+  record->private_data = srecord;
+  record->metadata = blob_new_from_headers (impl, headers, n_headers, EOS_SHARD_V2_BLOB_METADATA);
+  record->data = blob_new_from_headers (impl, headers, n_headers, EOS_SHARD_V2_BLOB_DATA);
+  return record;
+}
+
+/* Looking up a record reads its blob table, then the blob headers the
+ * table points at. Rather than doing that record by record, read each
+ * level for all of the records as one batch, and build the records from
+ * what was read. A mapped file needs no reads, so its records are built
+ * straight from the mapping. */
+static void
+find_records_by_raw_names (EosShardShardFileImpl *impl, const uint8_t *raw_names, guint n_names,
+                           EosShardRecord **records)
+{
+  EosShardShardFileImplV2 *self = EOS_SHARD_SHARD_FILE_IMPL_V2 (impl);
+  g_autofree struct eos_shard_v2_record **srecords = g_new0 (struct eos_shard_v2_record *, n_names);
+  guint i, t, n_found = 0, n_blobs = 0;
+  gsize j;
+
+  for (i = 0; i < n_names; i++) {
+    records[i] = NULL;
+    srecords[i] = lookup_srecord (self, raw_names + i * EOS_SHARD_RAW_NAME_SIZE);
+    if (srecords[i] == NULL)
+      continue;
+
+    if (self->map != NULL) {
+      records[i] = record_new (impl, srecords[i]);
+      continue;
+    }
+
+    n_found++;
+    n_blobs += srecords[i]->blob_table_length;
+  }
+
+  if (n_found == 0)
+    return;
+
+  /* First the blob tables, remembering which record each belongs to. */
+  g_autoptr(GArray) tables = g_array_sized_new (FALSE, TRUE, sizeof (struct eos_shard_read_request), n_found);
+  g_autofree guint *table_records = g_new (guint, n_found);
+
+  g_array_set_clear_func (tables, (GDestroyNotify) read_request_clear);
+
+  for (i = 0; i < n_names; i++) {
+    if (srecords[i] == NULL)
+      continue;
+
+    struct eos_shard_read_request request = {
+      .count = srecords[i]->blob_table_length * sizeof (struct eos_shard_v2_record_blob_table_entry),
+      .offset = srecords[i]->blob_table_start,
+    };
+    request.buf = g_malloc (request.count);
+    table_records[tables->len] = i;
+    g_array_append_val (tables, request);
+  }
+
+  _eos_shard_shard_file_read_batch (self->shard_file, (struct eos_shard_read_request *) tables->data, tables->len);
+
+  /* Then the blob headers; table t's are headers[first_header[t]] up to
+   * headers[first_header[t + 1]]. */
+  g_autoptr(GArray) headers = g_array_sized_new (FALSE, TRUE, sizeof (struct eos_shard_read_request), n_blobs);
+  g_autofree struct eos_shard_v2_blob *header_bufs = g_new (struct eos_shard_v2_blob, n_blobs);
+  g_autofree guint *first_header = g_new (guint, tables->len + 1);
+
+  for (t = 0; t < tables->len; t++) {
+    struct eos_shard_read_request *table = &g_array_index (tables, struct eos_shard_read_request, t);
+    const struct eos_shard_v2_record_blob_table_entry *entries = table->buf;
+
+    first_header[t] = headers->len;
+    if (table->result != (gssize) table->count)
+      continue;
+
+    for (j = 0; j < table->count / sizeof (*entries); j++) {
+      struct eos_shard_read_request request = {
+        .buf = &header_bufs[headers->len],
+        .count = sizeof (struct eos_shard_v2_blob),
+        .offset = entries[j].blob_start,
+      };
+      g_array_append_val (headers, request);
+    }
+  }
+  first_header[tables->len] = headers->len;
+
+  _eos_shard_shard_file_read_batch (self->shard_file, (struct eos_shard_read_request *) headers->data, headers->len);
+
+  for (t = 0; t < tables->len; t++) {
+    guint idx = table_records[t];
+    records[idx] = record_new_from_headers (impl, srecords[idx],
+                                            (struct eos_shard_read_request *) headers->data + first_header[t],
+                                            first_header[t + 1] - first_header[t]);
+  }
+}
+
+static guint
+get_n_raw_names (EosShardShardFileImpl *impl)
+{
+  EosShardShardFileImplV2 *self = EOS_SHARD_SHARD_FILE_IMPL_V2 (impl);
+  return self->hdr.records_length;
+}
+
+static const uint8_t *
+get_raw_name (EosShardShardFileImpl *impl, guint idx, gboolean *tombstone)
+{
+  EosShardShardFileImplV2 *self = EOS_SHARD_SHARD_FILE_IMPL_V2 (impl);
+  struct eos_shard_v2_record *srecord = &self->records[idx];
+
+  *tombstone = record_is_tombstone (srecord);
+  return srecord->raw_name;
+}
+
 static GSList *
 list_records (EosShardShardFileImpl *impl)
 {
@@ -289,21 +599,57 @@ list_blobs (EosShardShardFileImpl *impl, EosShardRecord *record)
   int i;
 
   for (i = 0; i < srecord->blob_table_length; i++) {
-    struct eos_shard_v2_record_blob_table_entry entry;
-    if (pread (self->fd, &entry, sizeof (entry), srecord->blob_table_start + i*sizeof (entry)) != sizeof (entry))
+    struct eos_shard_v2_blob sblob_buf;
+    const struct eos_shard_v2_blob *sblob = get_blob_header (self, srecord, i, &sblob_buf);
+    if (sblob == NULL)
       continue;
 
-    struct eos_shard_v2_blob sblob;
-    if (pread (self->fd, &sblob, sizeof (sblob), entry.blob_start) != sizeof (sblob))
-      continue;
-
-    EosShardBlob *blob = blob_new (impl, &sblob);
+    EosShardBlob *blob = blob_new (impl, sblob);
     l = g_slist_prepend (l, blob);
   }
 
   return l;
 }
 
+static GBytes *
+map_data (EosShardShardFileImpl *impl, uint64_t offset, uint64_t size)
+{
+  EosShardShardFileImplV2 *self = EOS_SHARD_SHARD_FILE_IMPL_V2 (impl);
+
+  if (self->map_bytes == NULL)
+    return NULL;
+
+  if (offset > self->map_size || size > self->map_size - offset)
+    return NULL;
+
+  /* The new GBytes holds a reference on the mapping, so it stays valid
+   * even after the shard file itself goes away. */
+  return g_bytes_new_from_bytes (self->map_bytes, offset, size);
+}
+
+static GBytes *
+get_zstd_dictionary (EosShardShardFileImpl *impl)
+{
+  EosShardShardFileImplV2 *self = EOS_SHARD_SHARD_FILE_IMPL_V2 (impl);
+  uint64_t start = self->hdr.zstd_dictionary_start;
+  uint64_t size = self->hdr.zstd_dictionary_size;
+
+  if (!(self->hdr.flags & EOS_SHARD_V2_HDR_FLAG_ZSTD_DICTIONARY))
+    return NULL;
+
+  GBytes *bytes = map_data (impl, start, size);
+  if (bytes != NULL)
+    return bytes;
+
+  uint8_t *buf = g_malloc (size);
+  if (pread (self->fd, buf, size, start) != size) {
+    g_free (buf);
+    return NULL;
+  }
+
+  return g_bytes_new_take (buf, size);
+}
+
 static void
 shard_file_impl_init (EosShardShardFileImplInterface *iface)
 {
@@ -312,4 +658,9 @@ shard_file_impl_init (EosShardShardFileImplInterface *iface)
   iface->lookup_blob = lookup_blob;
   iface->list_blobs = list_blobs;
   iface->records_foreach = records_foreach;
+  iface->get_n_raw_names = get_n_raw_names;
+  iface->get_raw_name = get_raw_name;
+  iface->map_data = map_data;
+  iface->get_zstd_dictionary = get_zstd_dictionary;
+  iface->find_records_by_raw_names = find_records_by_raw_names;
 }
@@ -48,6 +48,31 @@ struct _EosShardShardFileImplInterface
   void              (* records_foreach)         (EosShardShardFileImpl  *self,
                                                  EosShardRecordsForeachFunc func,
                                                  gpointer user_data);
+
+  /* The file's record names, tombstones included, in sorted order. The
+   * returned names stay valid for as long as the implementation does. */
+  guint             (* get_n_raw_names)         (EosShardShardFileImpl  *self);
+  const uint8_t *   (* get_raw_name)            (EosShardShardFileImpl  *self,
+                                                 guint                   idx,
+                                                 gboolean               *tombstone);
+
+  /* Optional. Returns a #GBytes referencing the given range of the file
+   * without copying it, or %NULL if the implementation can't do that. */
+  GBytes *          (* map_data)                (EosShardShardFileImpl  *self,
+                                                 uint64_t                offset,
+                                                 uint64_t                size);
+
+  /* Optional. Returns the zstd dictionary shared by the file's blobs, or
+   * %NULL if there is none. */
+  GBytes *          (* get_zstd_dictionary)     (EosShardShardFileImpl  *self);
+
+  /* Optional. Looks up the records with the given raw names, packed one
+   * after another in @raw_names, storing each record or %NULL in
+   * @records. Implementations can batch the reads for all of them. */
+  void              (* find_records_by_raw_names) (EosShardShardFileImpl  *self,
+                                                   const uint8_t          *raw_names,
+                                                   guint                   n_names,
+                                                   EosShardRecord        **records);
 };
 
 #endif /* EOS_SHARD_SHARD_FILE_IMPL_H */
@@ -26,10 +26,18 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/sendfile.h>
+#include <unistd.h>
+#include <zstd.h>
+
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
 
 #include "eos-shard-enums.h"
 #include "eos-shard-blob.h"
 #include "eos-shard-record.h"
+#include "eos-shard-codec.h"
 #include "eos-shard-dictionary.h"
 
 #include "eos-shard-format-v1.h"
@@ -49,15 +57,39 @@ struct _EosShardShardFile
 
   char *path;
   int fd;
+
+  EosShardChecksumPolicy checksum_policy;
+
+  /* Offsets of blobs whose checksums have already been verified. */
+  GMutex verified_lock;
+  GHashTable *verified_offsets;
+
+  /* The shard's zstd dictionary, loaded on first use. */
+  GMutex zstd_ddict_lock;
+  gboolean zstd_ddict_loaded;
+  ZSTD_DDict *zstd_ddict;
+
+#ifdef HAVE_LIBURING
+  /* The io_uring for batched reads, set up on first use and shared by
+   * everyone reading from this file, one batch at a time. */
+  GMutex ring_lock;
+  struct io_uring ring;
+  gboolean have_ring;
+  gboolean ring_failed;
+#endif
 };
 
 enum
 {
   PROP_0,
   PROP_PATH,
+  PROP_CHECKSUM_POLICY,
   LAST_PROP,
 };
 
+/* With EOS_SHARD_CHECKSUM_POLICY_SAMPLED, one in this many loads is verified. */
+#define CHECKSUM_SAMPLE_RATE 16
+
 enum
 {
    NOT_INITIALIZED,
@@ -241,6 +273,10 @@ eos_shard_shard_file_set_property (GObject      *object,
     self->path = g_value_dup_string (value);
     break;
 
+  case PROP_CHECKSUM_POLICY:
+    self->checksum_policy = g_value_get_enum (value);
+    break;
+
   default:
     G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
   }
@@ -259,6 +295,10 @@ eos_shard_shard_file_get_property (GObject    *object,
     g_value_set_string (value, self->path);
     break;
 
+  case PROP_CHECKSUM_POLICY:
+    g_value_set_enum (value, self->checksum_policy);
+    break;
+
   default:
     G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
   }
@@ -269,11 +309,21 @@ eos_shard_shard_file_finalize (GObject *object)
 {
   EosShardShardFile *self = EOS_SHARD_SHARD_FILE (object);
 
+#ifdef HAVE_LIBURING
+  if (self->have_ring)
+    io_uring_queue_exit (&self->ring);
+  g_mutex_clear (&self->ring_lock);
+#endif
+
   close (self->fd);
   g_clear_object (&self->impl);
   g_clear_pointer (&self->path, g_free);
   g_clear_error (&self->init_error);
   g_list_free_full (self->init_results, g_object_unref);
+  g_hash_table_unref (self->verified_offsets);
+  g_mutex_clear (&self->verified_lock);
+  ZSTD_freeDDict (self->zstd_ddict);
+  g_mutex_clear (&self->zstd_ddict_lock);
 
   G_OBJECT_CLASS (eos_shard_shard_file_parent_class)->finalize (object);
 }
@@ -296,12 +346,28 @@ eos_shard_shard_file_class_init (EosShardShardFileClass *klass)
                                         G_PARAM_CONSTRUCT_ONLY |
                                         G_PARAM_STATIC_STRINGS));
 
+  obj_props[PROP_CHECKSUM_POLICY] =
+    g_param_spec_enum ("checksum-policy",
+                       "Checksum policy",
+                       "When to verify blob checksums on load",
+                       EOS_SHARD_TYPE_CHECKSUM_POLICY,
+                       EOS_SHARD_CHECKSUM_POLICY_ALWAYS,
+                       (GParamFlags) (G_PARAM_READWRITE |
+                                      G_PARAM_STATIC_STRINGS));
+
   g_object_class_install_properties (gobject_class, LAST_PROP, obj_props);
 }
 
-static void 
-eos_shard_shard_file_init (EosShardShardFile *shard_file)
+static void
+eos_shard_shard_file_init (EosShardShardFile *self)
 {
+  self->checksum_policy = EOS_SHARD_CHECKSUM_POLICY_ALWAYS;
+  g_mutex_init (&self->verified_lock);
+  self->verified_offsets = g_hash_table_new_full (g_int64_hash, g_int64_equal, g_free, NULL);
+  g_mutex_init (&self->zstd_ddict_lock);
+#ifdef HAVE_LIBURING
+  g_mutex_init (&self->ring_lock);
+#endif
 }
 
 /**
@@ -382,6 +448,115 @@ eos_shard_shard_file_find_record_by_hex_name (EosShardShardFile *self, const cha
   return eos_shard_shard_file_find_record_by_raw_name (self, raw_name);
 }
 
+static void
+find_record_thread (GTask        *task,
+                    gpointer      source_object,
+                    gpointer      task_data,
+                    GCancellable *cancellable)
+{
+  EosShardShardFile *self = source_object;
+  const char *hex_name = task_data;
+
+  EosShardRecord *record = eos_shard_shard_file_find_record_by_hex_name (self, hex_name);
+  g_task_return_pointer (task, record, (GDestroyNotify) eos_shard_record_unref);
+}
+
+/**
+ * eos_shard_shard_file_find_record_by_hex_name_async:
+ * @self: the file
+ * @hex_name: the hex name to look up
+ * @cancellable: (allow-none): a #GCancellable
+ * @callback: the function to call when the lookup is done
+ * @user_data: user data to pass to @callback
+ *
+ * Asynchronous version of eos_shard_shard_file_find_record_by_hex_name(),
+ * which reads the record's blob headers in a worker thread.
+ */
+void
+eos_shard_shard_file_find_record_by_hex_name_async (EosShardShardFile   *self,
+                                                    const char          *hex_name,
+                                                    GCancellable        *cancellable,
+                                                    GAsyncReadyCallback  callback,
+                                                    gpointer             user_data)
+{
+  g_autoptr(GTask) task = g_task_new (self, cancellable, callback, user_data);
+  g_task_set_source_tag (task, eos_shard_shard_file_find_record_by_hex_name_async);
+  g_task_set_task_data (task, g_strdup (hex_name), g_free);
+  g_task_run_in_thread (task, find_record_thread);
+}
+
+/**
+ * eos_shard_shard_file_find_record_by_hex_name_finish:
+ * @self: the file
+ * @result: the #GAsyncResult passed to the callback
+ * @error: return location for a #GError
+ *
+ * Returns: (transfer full): the #EosShardRecord with the given hex name,
+ *   or %NULL if there is none
+ */
+EosShardRecord *
+eos_shard_shard_file_find_record_by_hex_name_finish (EosShardShardFile  *self,
+                                                     GAsyncResult       *result,
+                                                     GError            **error)
+{
+  g_return_val_if_fail (g_task_is_valid (result, self), NULL);
+
+  return g_task_propagate_pointer (G_TASK (result), error);
+}
+
+static void
+record_unref_if_set (gpointer record)
+{
+  if (record != NULL)
+    eos_shard_record_unref (record);
+}
+
+/**
+ * eos_shard_shard_file_find_records_by_hex_names:
+ * @self: the file
+ * @hex_names: (array zero-terminated=1): the hex names to look up
+ *
+ * Finds the records for all of the given hex names at once. This is
+ * faster than looking them up one by one, since the reads for all of
+ * the lookups are issued together.
+ *
+ * Returns: (transfer full) (element-type EosShardRecord): an array with
+ *   the #EosShardRecord for each name in @hex_names, in the same order,
+ *   or %NULL in place of the names that weren't found
+ */
+GPtrArray *
+eos_shard_shard_file_find_records_by_hex_names (EosShardShardFile  *self,
+                                                const char * const *hex_names)
+{
+  EosShardShardFileImplInterface *iface = EOS_SHARD_SHARD_FILE_IMPL_GET_IFACE (self->impl);
+  guint n_names = g_strv_length ((char **) hex_names);
+  g_autofree uint8_t *raw_names = g_malloc (n_names * EOS_SHARD_RAW_NAME_SIZE);
+  g_autofree gboolean *valid = g_new0 (gboolean, n_names);
+  guint i, n_valid = 0;
+
+  for (i = 0; i < n_names; i++) {
+    uint8_t *raw_name = raw_names + n_valid * EOS_SHARD_RAW_NAME_SIZE;
+    valid[i] = eos_shard_util_hex_name_to_raw_name (raw_name, hex_names[i]);
+    if (valid[i])
+      n_valid++;
+  }
+
+  g_autofree EosShardRecord **found = g_new0 (EosShardRecord *, n_valid);
+  if (iface->find_records_by_raw_names != NULL) {
+    iface->find_records_by_raw_names (self->impl, raw_names, n_valid, found);
+  } else {
+    for (i = 0; i < n_valid; i++)
+      found[i] = iface->find_record_by_raw_name (self->impl, raw_names + i * EOS_SHARD_RAW_NAME_SIZE);
+  }
+
+  GPtrArray *records = g_ptr_array_new_full (n_names, record_unref_if_set);
+  guint n_found = 0;
+  for (i = 0; i < n_names; i++)
+    g_ptr_array_add (records, valid[i] ? found[n_found++] : NULL);
+
+  return records;
+}
+
 /**
  * eos_shard_shard_file_list_records:
  *
@@ -413,64 +588,518 @@ eos_shard_shard_file_records_foreach (EosShardShardFile *self,
   iface->records_foreach (self->impl, func, user_data);
 }
 
+/* Returns the digested zstd dictionary shared by the shard's blobs, or
+ * %NULL if there is none. It is only loaded once per shard file. */
+const ZSTD_DDict *
+_eos_shard_shard_file_get_zstd_ddict (EosShardShardFile *self)
+{
+  EosShardShardFileImplInterface *iface = EOS_SHARD_SHARD_FILE_IMPL_GET_IFACE (self->impl);
+
+  g_mutex_lock (&self->zstd_ddict_lock);
+
+  if (!self->zstd_ddict_loaded) {
+    if (iface->get_zstd_dictionary != NULL) {
+      g_autoptr(GBytes) bytes = iface->get_zstd_dictionary (self->impl);
+      if (bytes != NULL)
+        self->zstd_ddict = ZSTD_createDDict (g_bytes_get_data (bytes, NULL), g_bytes_get_size (bytes));
+    }
+
+    self->zstd_ddict_loaded = TRUE;
+  }
+
+  g_mutex_unlock (&self->zstd_ddict_lock);
+
+  return self->zstd_ddict;
+}
+
 gsize
 _eos_shard_shard_file_read_data (EosShardShardFile *self, void *buf, gsize count, goffset offset)
 {
   return pread (self->fd, buf, count, offset);
 }
 
-GBytes *
-_eos_shard_shard_file_load_blob (EosShardShardFile *self, EosShardBlob *blob, GError **error)
+/* Hints to the kernel that the given range of the shard file will be read
+ * soon, so it can start reading it in. */
+void
+_eos_shard_shard_file_advise_willneed (EosShardShardFile *self, goffset offset, gsize count)
+{
+  posix_fadvise (self->fd, offset, count, POSIX_FADV_WILLNEED);
+}
+
+#ifdef HAVE_LIBURING
+#define READ_BATCH_QUEUE_DEPTH 64
+
+/* Stops using the ring for good. Closing it cancels anything still in
+ * flight, and drops anything queued but never submitted, which would
+ * otherwise go out with the next batch. */
+static void
+give_up_ring (EosShardShardFile *self)
+{
+  io_uring_queue_exit (&self->ring);
+  self->have_ring = FALSE;
+  self->ring_failed = TRUE;
+}
+
+/* Submits the requests to the file's io_uring, keeping up to
+ * READ_BATCH_QUEUE_DEPTH of them in flight at once, and marks the ones
+ * that finished as completed. If the ring can't be set up or stops
+ * working, the rest are left for the caller. */
+static void
+read_batch_uring (EosShardShardFile *self, struct eos_shard_read_request *requests, guint n_requests)
+{
+  guint queued = 0, submitted = 0, completed = 0;
+  gboolean can_submit = TRUE;
+
+  g_mutex_lock (&self->ring_lock);
+
+  if (!self->have_ring && !self->ring_failed) {
+    if (io_uring_queue_init (READ_BATCH_QUEUE_DEPTH, &self->ring, 0) == 0)
+      self->have_ring = TRUE;
+    else
+      self->ring_failed = TRUE;
+  }
+
+  if (!self->have_ring) {
+    g_mutex_unlock (&self->ring_lock);
+    return;
+  }
+
+  for (;;) {
+    while (can_submit && queued < n_requests && queued - completed < READ_BATCH_QUEUE_DEPTH) {
+      struct io_uring_sqe *sqe = io_uring_get_sqe (&self->ring);
+      if (sqe == NULL)
+        break;
+
+      struct eos_shard_read_request *request = &requests[queued];
+      io_uring_prep_read (sqe, self->fd, request->buf, request->count, request->offset);
+      io_uring_sqe_set_data (sqe, request);
+      queued++;
+    }
+
+    if (can_submit && submitted < queued) {
+      int ret = io_uring_submit (&self->ring);
+      if (ret > 0)
+        submitted += ret;
+      else if (ret < 0 && ret != -EINTR && ret != -EAGAIN)
+        can_submit = FALSE;
+    }
+
+    if (completed == submitted)
+      break;
+
+    struct io_uring_cqe *cqe;
+    int ret = io_uring_wait_cqe (&self->ring, &cqe);
+    if (ret == -EINTR)
+      continue;
+    if (ret < 0) {
+      give_up_ring (self);
+      break;
+    }
+
+    struct eos_shard_read_request *request = io_uring_cqe_get_data (cqe);
+    if (cqe->res == -EINVAL) {
+      /* Kernels before 5.6 don't know IORING_OP_READ. */
+      request->result = pread (self->fd, request->buf, request->count, request->offset);
+    } else if (cqe->res < 0) {
+      request->result = -1;
+      errno = -cqe->res;
+    } else {
+      request->result = cqe->res;
+    }
+    request->completed = TRUE;
+    io_uring_cqe_seen (&self->ring, cqe);
+    completed++;
+  }
+
+  if (self->have_ring && submitted < queued)
+    give_up_ring (self);
+
+  g_mutex_unlock (&self->ring_lock);
+}
+#endif
+
+/* Performs a batch of independent reads from the shard file. With io_uring
+ * they are all in flight together; otherwise the kernel is told about all
+ * of the ranges before they are read one by one. */
+void
+_eos_shard_shard_file_read_batch (EosShardShardFile *self, struct eos_shard_read_request *requests, guint n_requests)
+{
+  guint i;
+
+  if (n_requests == 0)
+    return;
+
+  for (i = 0; i < n_requests; i++)
+    requests[i].completed = FALSE;
+
+#ifdef HAVE_LIBURING
+  read_batch_uring (self, requests, n_requests);
+#endif
+
+  for (i = 0; i < n_requests; i++) {
+    if (!requests[i].completed)
+      _eos_shard_shard_file_advise_willneed (self, requests[i].offset, requests[i].count);
+  }
+
+  for (i = 0; i < n_requests; i++) {
+    if (requests[i].completed)
+      continue;
+
+    do
+      requests[i].result = pread (self->fd, requests[i].buf, requests[i].count, requests[i].offset);
+    while (requests[i].result < 0 && errno == EINTR);
+    requests[i].completed = TRUE;
+  }
+}
+
+/* Copies data from the shard file to @out_fd inside the kernel. Like
+ * sendfile(), returns the number of bytes sent, or -1 with errno set. */
+gssize
+_eos_shard_shard_file_send_data (EosShardShardFile *self, int out_fd, gsize count, goffset offset)
+{
+  off_t offs = offset;
+  return sendfile (out_fd, self->fd, &offs, count);
+}
+
+/* Copies data from the shard file to @out_fd at @out_offset inside the
+ * kernel, which can share the extents instead of duplicating them on
+ * filesystems that support it. Like copy_file_range(), returns the number
+ * of bytes copied, or -1 with errno set. */
+gssize
+_eos_shard_shard_file_copy_data (EosShardShardFile *self, int out_fd, goffset out_offset, gsize count, goffset offset)
+{
+#ifdef HAVE_COPY_FILE_RANGE
+  loff_t in_offs = offset;
+  loff_t out_offs = out_offset;
+  return copy_file_range (self->fd, &in_offs, out_fd, &out_offs, count, 0);
+#else
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
+/* Reads exactly the blob's packed size into @buf, retrying short reads.
+ * Running out of file before that is an error, since the shard must be
+ * truncated. */
+static gboolean
+read_packed_blob_into (EosShardShardFile *self, EosShardBlob *blob, uint8_t *buf, GError **error)
+{
+  gsize total = 0;
+
+  while (total < blob->size) {
+    gssize size_read = _eos_shard_shard_file_read_data (self, buf + total, blob->size - total, blob->offs + total);
+    if (size_read < 0) {
+      int read_error = errno;
+      if (read_error == EINTR)
+        continue;
+      g_set_error (error, EOS_SHARD_ERROR, EOS_SHARD_ERROR_BLOB_STREAM_READ,
+                   "Read failed: %s", strerror (read_error));
+      return FALSE;
+    }
+    if (size_read == 0) {
+      g_set_error (error, EOS_SHARD_ERROR, EOS_SHARD_ERROR_BLOB_STREAM_READ,
+                   "Read failed: blob is truncated");
+      return FALSE;
+    }
+    total += size_read;
+  }
+
+  return TRUE;
+}
+
+/* Returns the packed (possibly compressed) contents of the blob. When the
+ * file is mapped, this references the mapped pages directly. */
+static GBytes *
+read_packed_blob (EosShardShardFile *self, EosShardBlob *blob, GError **error)
 {
+  EosShardShardFileImplInterface *iface = EOS_SHARD_SHARD_FILE_IMPL_GET_IFACE (self->impl);
+
+  if (iface->map_data != NULL) {
+    GBytes *bytes = iface->map_data (self->impl, blob->offs, blob->size);
+    if (bytes != NULL)
+      return bytes;
+  }
+
   uint8_t *buf = g_malloc (blob->size);
 
-  size_t size_read = _eos_shard_shard_file_read_data (self, buf, blob->size, blob->offs);
-  int read_error = errno;
-  if (size_read == -1) {
-    g_set_error (error, EOS_SHARD_ERROR, EOS_SHARD_ERROR_BLOB_STREAM_READ,
-                 "Read failed: %s", strerror (read_error));
+  if (!read_packed_blob_into (self, blob, buf, error)) {
+    g_free (buf);
     return NULL;
   }
 
-  GBytes *bytes = g_bytes_new_take (buf, blob->size);
+  return g_bytes_new_take (buf, blob->size);
+}
 
+static gboolean
+verify_packed_data (EosShardBlob *blob, const void *data, gsize size, GError **error)
+{
   g_autoptr(GChecksum) checksum = g_checksum_new (G_CHECKSUM_SHA256);
-  uint8_t checksum_buf[32];
-  g_checksum_update (checksum, buf, blob->size);
-  size_t checksum_buf_len = sizeof (checksum_buf);
-  g_checksum_get_digest (checksum, checksum_buf, &checksum_buf_len);
-  g_assert (checksum_buf_len == sizeof (checksum_buf));
-
-  if (memcmp (checksum_buf, blob->checksum, sizeof (checksum_buf)) != 0) {
-    g_clear_pointer (&bytes, g_bytes_unref);
-    g_set_error (error, EOS_SHARD_ERROR, EOS_SHARD_ERROR_BLOB_CHECKSUM_MISMATCH,
-                 "Could not load blob: checksum did not match");
+  g_checksum_update (checksum, data, size);
+  return _eos_shard_blob_check_checksum (blob, checksum, error);
+}
+
+static gboolean
+verify_packed_blob (EosShardBlob *blob, GBytes *bytes, GError **error)
+{
+  return verify_packed_data (blob, g_bytes_get_data (bytes, NULL), g_bytes_get_size (bytes), error);
+}
+
+gboolean
+_eos_shard_shard_file_should_verify_blob (EosShardShardFile *self, EosShardBlob *blob)
+{
+  gboolean verified;
+
+  switch (self->checksum_policy) {
+  case EOS_SHARD_CHECKSUM_POLICY_ALWAYS:
+    return TRUE;
+
+  case EOS_SHARD_CHECKSUM_POLICY_ONCE:
+    g_mutex_lock (&self->verified_lock);
+    verified = g_hash_table_contains (self->verified_offsets, &blob->offs);
+    g_mutex_unlock (&self->verified_lock);
+    return !verified;
+
+  case EOS_SHARD_CHECKSUM_POLICY_SAMPLED:
+    return g_random_int_range (0, CHECKSUM_SAMPLE_RATE) == 0;
+
+  case EOS_SHARD_CHECKSUM_POLICY_NEVER:
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+static void
+remember_verified_blob (EosShardShardFile *self, EosShardBlob *blob)
+{
+  gint64 *offs = g_new (gint64, 1);
+  *offs = blob->offs;
+
+  g_mutex_lock (&self->verified_lock);
+  g_hash_table_add (self->verified_offsets, offs);
+  g_mutex_unlock (&self->verified_lock);
+}
+
+/* Called once a blob's checksum has been verified on load. */
+void
+_eos_shard_shard_file_mark_blob_verified (EosShardShardFile *self, EosShardBlob *blob)
+{
+  /* Only the "once" policy looks at this, so don't grow the set otherwise. */
+  if (self->checksum_policy == EOS_SHARD_CHECKSUM_POLICY_ONCE)
+    remember_verified_blob (self, blob);
+}
+
+/* Decodes the blob's packed data in one go, straight into @buf, which must
+ * hold exactly the blob's uncompressed size. */
+static gboolean
+decode_packed_blob_into (EosShardBlob *blob, GBytes *bytes, void *buf, GError **error)
+{
+  gsize size;
+  const uint8_t *data = g_bytes_get_data (bytes, &size);
+  const ZSTD_DDict *ddict = _eos_shard_blob_get_zstd_ddict (blob);
+
+  if (!(blob->flags & EOS_SHARD_BLOB_FLAG_CHUNKED))
+    return codec_decode_into (blob->flags, ddict, data, size, buf, blob->uncompressed_size, error);
+
+  struct chunk_table table;
+  uint32_t i;
+
+  if (!chunk_table_init (&table, data, size, size, blob->uncompressed_size, error))
+    return FALSE;
+
+  for (i = 0; i < table.n_chunks; i++) {
+    if (!codec_decode_into (blob->flags, ddict,
+                            data + table.offsets[i], table.offsets[i + 1] - table.offsets[i],
+                            (uint8_t *) buf + (uint64_t) i * table.chunk_size,
+                            chunk_table_chunk_length (&table, blob->uncompressed_size, i),
+                            error)) {
+      chunk_table_dispose (&table);
+      return FALSE;
+    }
+  }
+
+  chunk_table_dispose (&table);
+  return TRUE;
+}
+
+static gboolean
+check_packed_blob (EosShardShardFile *self, EosShardBlob *blob, const void *data, gsize size, GError **error)
+{
+  if (!_eos_shard_shard_file_should_verify_blob (self, blob))
+    return TRUE;
+
+  if (!verify_packed_data (blob, data, size, error))
+    return FALSE;
+
+  _eos_shard_shard_file_mark_blob_verified (self, blob);
+  return TRUE;
+}
+
+/* Loads the blob's content into @buf, which must hold at least the blob's
+ * uncompressed size. Compressed blobs are decoded straight into it. */
+gboolean
+_eos_shard_shard_file_load_blob_into (EosShardShardFile *self, EosShardBlob *blob, void *buf, GError **error)
+{
+  if (!_eos_shard_blob_is_compressed (blob)) {
+    if (!read_packed_blob_into (self, blob, buf, error))
+      return FALSE;
+
+    return check_packed_blob (self, blob, buf, blob->size, error);
+  }
+
+  g_autoptr(GBytes) bytes = read_packed_blob (self, blob, error);
+  if (bytes == NULL)
+    return FALSE;
+
+  if (!check_packed_blob (self, blob, g_bytes_get_data (bytes, NULL), g_bytes_get_size (bytes), error))
+    return FALSE;
+
+  return decode_packed_blob_into (blob, bytes, buf, error);
+}
+
+GBytes *
+_eos_shard_shard_file_load_blob (EosShardShardFile *self, EosShardBlob *blob, GError **error)
+{
+  /* Uncompressed data can be handed out as-is, which references the
+   * mapping if we have one. */
+  if (!_eos_shard_blob_is_compressed (blob)) {
+    GBytes *bytes = read_packed_blob (self, blob, error);
+    if (bytes == NULL)
+      return NULL;
+
+    if (!check_packed_blob (self, blob, g_bytes_get_data (bytes, NULL), g_bytes_get_size (bytes), error)) {
+      g_bytes_unref (bytes);
+      return NULL;
+    }
+
+    return bytes;
+  }
+
+  /* Otherwise, decode into a single allocation of exactly the right size. */
+  uint8_t *buf = g_malloc (blob->uncompressed_size);
+  if (!_eos_shard_shard_file_load_blob_into (self, blob, buf, error)) {
+    g_free (buf);
     return NULL;
   }
 
-  if (blob->flags & EOS_SHARD_BLOB_FLAG_COMPRESSED_ZLIB) {
-    g_autoptr(GInputStream) bytestream = NULL;
-    g_autoptr(GZlibDecompressor) decompressor = NULL;
-    g_autoptr(GInputStream) out_stream = NULL;
+  return g_bytes_new_take (buf, blob->uncompressed_size);
+}
+
+struct verify_all_data
+{
+  EosShardShardFile *self;
+  GCancellable *cancellable;
+
+  /* Protects the error below. */
+  GMutex lock;
+  GError *error;
+};
+
+static void
+collect_blobs (EosShardRecord *record, gpointer user_data)
+{
+  GHashTable *blobs = user_data;
+  GSList *list = eos_shard_record_list_blobs (record);
+  GSList *l;
+
+  for (l = list; l != NULL; l = l->next) {
+    EosShardBlob *blob = l->data;
+    if (blob == NULL)
+      continue;
+
+    /* Deduplicated blobs share the same data, so only check them once. */
+    if (g_hash_table_contains (blobs, &blob->offs))
+      eos_shard_blob_unref (blob);
+    else
+      g_hash_table_insert (blobs, &blob->offs, blob);
+  }
+
+  g_slist_free (list);
+}
+
+static void
+verify_blob_func (gpointer data, gpointer user_data)
+{
+  EosShardBlob *blob = data;
+  struct verify_all_data *vd = user_data;
+  g_autoptr(GError) error = NULL;
+  gboolean failed;
+
+  if (g_cancellable_is_cancelled (vd->cancellable))
+    return;
+
+  /* Don't bother with the rest once something has failed. */
+  g_mutex_lock (&vd->lock);
+  failed = (vd->error != NULL);
+  g_mutex_unlock (&vd->lock);
+  if (failed)
+    return;
+
+  g_autoptr(GBytes) bytes = read_packed_blob (vd->self, blob, &error);
+  if (bytes != NULL && verify_packed_blob (blob, bytes, &error)) {
+    remember_verified_blob (vd->self, blob);
+    return;
+  }
+
+  g_mutex_lock (&vd->lock);
+  if (vd->error == NULL)
+    vd->error = g_steal_pointer (&error);
+  g_mutex_unlock (&vd->lock);
+}
+
+/**
+ * eos_shard_shard_file_verify_all:
+ * @self: the file
+ * @cancellable: (allow-none): optional #GCancellable object, %NULL to ignore
+ * @error: return location for a #GError, or %NULL
+ *
+ * Verifies the checksum of every blob in the shard file up front, using a
+ * thread per processor. This is meant to be run once, e.g. at install time.
+ * Blobs that pass are remembered, so with %EOS_SHARD_CHECKSUM_POLICY_ONCE
+ * they won't be hashed again when they are loaded.
+ *
+ * Returns: %TRUE if every blob matched its checksum
+ */
+gboolean
+eos_shard_shard_file_verify_all (EosShardShardFile  *self,
+                                 GCancellable       *cancellable,
+                                 GError            **error)
+{
+  struct verify_all_data vd = { .self = self, .cancellable = cancellable };
+  g_autoptr(GHashTable) blobs = g_hash_table_new_full (g_int64_hash, g_int64_equal, NULL,
+                                                       (GDestroyNotify) eos_shard_blob_unref);
+  GHashTableIter iter;
+  gpointer blob;
+
+  eos_shard_shard_file_records_foreach (self, collect_blobs, blobs);
 
-    decompressor = g_zlib_decompressor_new (G_ZLIB_COMPRESSOR_FORMAT_ZLIB);
-    bytestream = g_memory_input_stream_new_from_bytes (bytes);
-    g_bytes_unref (bytes);
-    out_stream = g_converter_input_stream_new (G_INPUT_STREAM (bytestream), G_CONVERTER (decompressor));
+  g_mutex_init (&vd.lock);
 
-    g_autoptr(GError) err = NULL;
-    bytes = g_input_stream_read_bytes (out_stream, blob->uncompressed_size, NULL, &err);
-    if (err != NULL)
-      g_warning ("Could not decompress stream: %s", err->message);
+  GThreadPool *pool = g_thread_pool_new (verify_blob_func, &vd, g_get_num_processors (), FALSE, NULL);
+
+  g_hash_table_iter_init (&iter, blobs);
+  while (g_hash_table_iter_next (&iter, NULL, &blob))
+    g_thread_pool_push (pool, blob, NULL);
+
+  /* Wait for all of the queued blobs to be checked. */
+  g_thread_pool_free (pool, FALSE, TRUE);
+  g_mutex_clear (&vd.lock);
+
+  if (vd.error != NULL) {
+    g_propagate_error (error, vd.error);
+    return FALSE;
   }
 
-  return bytes;
+  if (g_cancellable_set_error_if_cancelled (cancellable, error))
+    return FALSE;
+
+  return TRUE;
 }
 
 EosShardDictionary *
 _eos_shard_shard_file_new_dictionary (EosShardShardFile *self, EosShardBlob *blob, GError **error)
 {
-  g_assert (!(blob->flags & EOS_SHARD_BLOB_FLAG_COMPRESSED_ZLIB));
+  g_assert (!_eos_shard_blob_is_compressed (blob));
   return eos_shard_dictionary_new_for_fd (self->fd, blob->offs, error);
 }
 
@@ -487,3 +1116,17 @@ _eos_shard_shard_file_list_blobs (EosShardShardFile *self, EosShardRecord *recor
   EosShardShardFileImplInterface *iface = EOS_SHARD_SHARD_FILE_IMPL_GET_IFACE (self->impl);
   return iface->list_blobs (self->impl, record);
 }
+
+guint
+_eos_shard_shard_file_get_n_raw_names (EosShardShardFile *self)
+{
+  EosShardShardFileImplInterface *iface = EOS_SHARD_SHARD_FILE_IMPL_GET_IFACE (self->impl);
+  return iface->get_n_raw_names (self->impl);
+}
+
+const uint8_t *
+_eos_shard_shard_file_get_raw_name (EosShardShardFile *self, guint idx, gboolean *tombstone)
+{
+  EosShardShardFileImplInterface *iface = EOS_SHARD_SHARD_FILE_IMPL_GET_IFACE (self->impl);
+  return iface->get_raw_name (self->impl, idx, tombstone);
+}
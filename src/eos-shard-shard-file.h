@@ -43,17 +43,62 @@ gboolean eos_shard_util_hex_name_to_raw_name (uint8_t raw_name[20], const char *
 
 EosShardRecord * eos_shard_shard_file_find_record_by_raw_name (EosShardShardFile *self, uint8_t *raw_name);
 EosShardRecord * eos_shard_shard_file_find_record_by_hex_name (EosShardShardFile *self, const char *hex_name);
+void eos_shard_shard_file_find_record_by_hex_name_async (EosShardShardFile   *self,
+                                                         const char          *hex_name,
+                                                         GCancellable        *cancellable,
+                                                         GAsyncReadyCallback  callback,
+                                                         gpointer             user_data);
+EosShardRecord * eos_shard_shard_file_find_record_by_hex_name_finish (EosShardShardFile  *self,
+                                                                      GAsyncResult       *result,
+                                                                      GError            **error);
+GPtrArray * eos_shard_shard_file_find_records_by_hex_names (EosShardShardFile  *self,
+                                                            const char * const *hex_names);
 GSList * eos_shard_shard_file_list_records (EosShardShardFile *self);
 void eos_shard_shard_file_records_foreach (EosShardShardFile *self, EosShardRecordsForeachFunc func, gpointer user_data);
+gboolean eos_shard_shard_file_verify_all (EosShardShardFile  *self,
+                                          GCancellable       *cancellable,
+                                          GError            **error);
 
 GBytes * _eos_shard_shard_file_load_blob (EosShardShardFile            *self,
                                           EosShardBlob                 *blob,
                                           GError                      **error);
+gboolean _eos_shard_shard_file_load_blob_into (EosShardShardFile  *self,
+                                               EosShardBlob       *blob,
+                                               void               *buf,
+                                               GError            **error);
 EosShardDictionary * _eos_shard_shard_file_new_dictionary (EosShardShardFile *self,
                                                            EosShardBlob *blob,
                                                            GError **error);
 
+gboolean _eos_shard_shard_file_should_verify_blob (EosShardShardFile *self, EosShardBlob *blob);
+void _eos_shard_shard_file_mark_blob_verified (EosShardShardFile *self, EosShardBlob *blob);
+
+#ifndef __GI_SCANNER__
+struct ZSTD_DDict_s;
+const struct ZSTD_DDict_s * _eos_shard_shard_file_get_zstd_ddict (EosShardShardFile *self);
+
+/* One read in a batch passed to _eos_shard_shard_file_read_batch(). On
+ * return, result holds what pread() would have returned. */
+struct eos_shard_read_request
+{
+  void *buf;
+  gsize count;
+  goffset offset;
+  gssize result;
+  gboolean completed;
+};
+
+void _eos_shard_shard_file_read_batch (EosShardShardFile *self,
+                                       struct eos_shard_read_request *requests,
+                                       guint n_requests);
+#endif
+
 gsize _eos_shard_shard_file_read_data (EosShardShardFile *self, void *buf, gsize count, goffset offset);
+void _eos_shard_shard_file_advise_willneed (EosShardShardFile *self, goffset offset, gsize count);
+gssize _eos_shard_shard_file_send_data (EosShardShardFile *self, int out_fd, gsize count, goffset offset);
+gssize _eos_shard_shard_file_copy_data (EosShardShardFile *self, int out_fd, goffset out_offset, gsize count, goffset offset);
 GSList * _eos_shard_shard_file_list_blobs (EosShardShardFile *self, EosShardRecord *record);
+guint _eos_shard_shard_file_get_n_raw_names (EosShardShardFile *self);
+const uint8_t * _eos_shard_shard_file_get_raw_name (EosShardShardFile *self, guint idx, gboolean *tombstone);
 
 EosShardBlob * _eos_shard_shard_file_lookup_blob (EosShardShardFile *self, EosShardRecord *record, const char *name);
@@ -0,0 +1,377 @@
+/* Copyright 2015 Endless Mobile, Inc. */
+
+/* This file is part of eos-shard.
+ *
+ * eos-shard is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * eos-shard is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with eos-shard.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "eos-shard-shard-set.h"
+
+#include <string.h>
+
+#include "eos-shard-record.h"
+
+struct _EosShardShardSet
+{
+  GObject parent;
+
+  /* Highest priority first. */
+  GPtrArray *shards;
+
+  /* Maps each raw name to the index of the highest priority shard which
+   * has it, plus one, or to INDEX_TOMBSTONE if that shard deleted it. The
+   * keys point into the shards' own record tables. */
+  GHashTable *index;
+};
+
+#define INDEX_TOMBSTONE GUINT_TO_POINTER (G_MAXUINT)
+
+G_DEFINE_TYPE (EosShardShardSet, eos_shard_shard_set, G_TYPE_OBJECT)
+
+static void
+eos_shard_shard_set_finalize (GObject *object)
+{
+  EosShardShardSet *self = EOS_SHARD_SHARD_SET (object);
+
+  g_clear_pointer (&self->index, g_hash_table_unref);
+  g_clear_pointer (&self->shards, g_ptr_array_unref);
+
+  G_OBJECT_CLASS (eos_shard_shard_set_parent_class)->finalize (object);
+}
+
+static void
+eos_shard_shard_set_class_init (EosShardShardSetClass *klass)
+{
+  GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
+
+  gobject_class->finalize = eos_shard_shard_set_finalize;
+}
+
+static guint
+raw_name_hash (gconstpointer key)
+{
+  /* Raw names are SHA-1 hashes, so their first bytes are as good a hash
+   * as any. */
+  guint hash;
+  memcpy (&hash, key, sizeof (hash));
+  return hash;
+}
+
+static gboolean
+raw_name_equal (gconstpointer a, gconstpointer b)
+{
+  return memcmp (a, b, EOS_SHARD_RAW_NAME_SIZE) == 0;
+}
+
+static void
+eos_shard_shard_set_init (EosShardShardSet *self)
+{
+  self->shards = g_ptr_array_new_with_free_func (g_object_unref);
+  self->index = g_hash_table_new (raw_name_hash, raw_name_equal);
+}
+
+static void
+build_index (EosShardShardSet *self)
+{
+  guint i = self->shards->len;
+
+  /* Go from the lowest priority shard up, so that each shard's entries
+   * replace the ones from the shards below it. */
+  while (i-- > 0) {
+    EosShardShardFile *shard_file = g_ptr_array_index (self->shards, i);
+    guint j, n_names = _eos_shard_shard_file_get_n_raw_names (shard_file);
+
+    for (j = 0; j < n_names; j++) {
+      gboolean tombstone;
+      const uint8_t *raw_name = _eos_shard_shard_file_get_raw_name (shard_file, j, &tombstone);
+      if (raw_name == NULL)
+        continue;
+
+      g_hash_table_insert (self->index, (gpointer) raw_name,
+                           tombstone ? INDEX_TOMBSTONE : GUINT_TO_POINTER (i + 1));
+    }
+  }
+}
+
+/**
+ * eos_shard_shard_set_new:
+ * @shard_files: (element-type EosShardShardFile) (transfer none): the
+ *   shard files to layer, highest priority first. They must already be
+ *   initialized.
+ *
+ * Creates a new shard set, building a combined index of the records in
+ * @shard_files so that lookups only have to look at a single shard.
+ *
+ * Returns: (transfer full): a new #EosShardShardSet
+ */
+EosShardShardSet *
+eos_shard_shard_set_new (GList *shard_files)
+{
+  EosShardShardSet *self = g_object_new (EOS_SHARD_TYPE_SHARD_SET, NULL);
+  GList *l;
+
+  for (l = shard_files; l != NULL; l = l->next)
+    g_ptr_array_add (self->shards, g_object_ref (l->data));
+
+  build_index (self);
+  return self;
+}
+
+/**
+ * eos_shard_shard_set_find_record_by_raw_name:
+ *
+ * Finds a #EosShardRecord for the given raw name in the highest priority
+ * shard that has it.
+ *
+ * Returns: (transfer full): the #EosShardRecord with the given raw name,
+ *   or %NULL if there is none or it was deleted by a tombstone
+ */
+EosShardRecord *
+eos_shard_shard_set_find_record_by_raw_name (EosShardShardSet *self, uint8_t *raw_name)
+{
+  gpointer value = g_hash_table_lookup (self->index, raw_name);
+
+  if (value == NULL || value == INDEX_TOMBSTONE)
+    return NULL;
+
+  EosShardShardFile *shard_file = g_ptr_array_index (self->shards, GPOINTER_TO_UINT (value) - 1);
+  return eos_shard_shard_file_find_record_by_raw_name (shard_file, raw_name);
+}
+
+/**
+ * eos_shard_shard_set_find_record_by_hex_name:
+ *
+ * Finds a #EosShardRecord for the given hex name in the highest priority
+ * shard that has it.
+ *
+ * Returns: (transfer full): the #EosShardRecord with the given hex name,
+ *   or %NULL if there is none or it was deleted by a tombstone
+ */
+EosShardRecord *
+eos_shard_shard_set_find_record_by_hex_name (EosShardShardSet *self, const char *hex_name)
+{
+  uint8_t raw_name[EOS_SHARD_RAW_NAME_SIZE];
+
+  if (!eos_shard_util_hex_name_to_raw_name (raw_name, hex_name))
+    return NULL;
+
+  return eos_shard_shard_set_find_record_by_raw_name (self, raw_name);
+}
+
+/* Returns the set's shards, highest priority first. */
+GPtrArray *
+_eos_shard_shard_set_get_shards (EosShardShardSet *self)
+{
+  return self->shards;
+}
+
+/* A position in one shard's sorted record names. */
+struct merge_cursor
+{
+  guint shard_idx;
+  guint pos;
+  guint n_names;
+  const uint8_t *raw_name;
+  gboolean tombstone;
+};
+
+struct _EosShardShardSetIter {
+  int ref_count;
+  EosShardShardSet *shard_set;
+
+  /* A min-heap of the cursors which haven't run off the end of their
+   * shards, ordered by name and then by shard priority. */
+  GArray *heap;
+};
+
+static gboolean
+cursor_less (const struct merge_cursor *a, const struct merge_cursor *b)
+{
+  int cmp = memcmp (a->raw_name, b->raw_name, EOS_SHARD_RAW_NAME_SIZE);
+  if (cmp != 0)
+    return cmp < 0;
+
+  /* For the same name, the higher priority shard comes first. */
+  return a->shard_idx < b->shard_idx;
+}
+
+/* Points the cursor at the name at its position, skipping any names the
+ * shard couldn't give us. Returns FALSE once the cursor is exhausted. */
+static gboolean
+cursor_load (EosShardShardSetIter *iter, struct merge_cursor *cursor)
+{
+  EosShardShardFile *shard_file = g_ptr_array_index (iter->shard_set->shards, cursor->shard_idx);
+
+  for (; cursor->pos < cursor->n_names; cursor->pos++) {
+    cursor->raw_name = _eos_shard_shard_file_get_raw_name (shard_file, cursor->pos, &cursor->tombstone);
+    if (cursor->raw_name != NULL)
+      return TRUE;
+  }
+
+  return FALSE;
+}
+
+#define HEAP_CURSOR(iter, i) (&g_array_index ((iter)->heap, struct merge_cursor, (i)))
+
+static void
+heap_swap (EosShardShardSetIter *iter, guint i, guint j)
+{
+  struct merge_cursor tmp = *HEAP_CURSOR (iter, i);
+  *HEAP_CURSOR (iter, i) = *HEAP_CURSOR (iter, j);
+  *HEAP_CURSOR (iter, j) = tmp;
+}
+
+static void
+heap_sift_up (EosShardShardSetIter *iter, guint i)
+{
+  while (i > 0) {
+    guint parent = (i - 1) / 2;
+    if (!cursor_less (HEAP_CURSOR (iter, i), HEAP_CURSOR (iter, parent)))
+      break;
+    heap_swap (iter, i, parent);
+    i = parent;
+  }
+}
+
+static void
+heap_sift_down (EosShardShardSetIter *iter, guint i)
+{
+  guint len = iter->heap->len;
+
+  for (;;) {
+    guint smallest = i;
+    guint left = 2 * i + 1, right = 2 * i + 2;
+
+    if (left < len && cursor_less (HEAP_CURSOR (iter, left), HEAP_CURSOR (iter, smallest)))
+      smallest = left;
+    if (right < len && cursor_less (HEAP_CURSOR (iter, right), HEAP_CURSOR (iter, smallest)))
+      smallest = right;
+    if (smallest == i)
+      break;
+
+    heap_swap (iter, i, smallest);
+    i = smallest;
+  }
+}
+
+/* Moves the top cursor on to its next name, dropping it from the heap if
+ * it has run out. */
+static void
+heap_advance_top (EosShardShardSetIter *iter)
+{
+  struct merge_cursor *top = HEAP_CURSOR (iter, 0);
+
+  top->pos++;
+  if (!cursor_load (iter, top)) {
+    *top = *HEAP_CURSOR (iter, iter->heap->len - 1);
+    g_array_set_size (iter->heap, iter->heap->len - 1);
+  }
+
+  if (iter->heap->len > 0)
+    heap_sift_down (iter, 0);
+}
+
+/**
+ * eos_shard_shard_set_iter_new:
+ * @shard_set: the shard set
+ *
+ * Creates an iterator over the records in @shard_set, in raw name order.
+ * Each name is returned once, from the highest priority shard that has
+ * it, and names deleted by a tombstone are skipped. The shards' sorted
+ * record tables are merged as the iterator goes, so records don't need to
+ * be loaded up front.
+ *
+ * Returns: (transfer full): a new iterator
+ */
+EosShardShardSetIter *
+eos_shard_shard_set_iter_new (EosShardShardSet *shard_set)
+{
+  EosShardShardSetIter *iter = g_new0 (EosShardShardSetIter, 1);
+  guint i;
+
+  iter->ref_count = 1;
+  iter->shard_set = g_object_ref (shard_set);
+  iter->heap = g_array_sized_new (FALSE, FALSE, sizeof (struct merge_cursor), shard_set->shards->len);
+
+  for (i = 0; i < shard_set->shards->len; i++) {
+    struct merge_cursor cursor = { .shard_idx = i };
+    cursor.n_names = _eos_shard_shard_file_get_n_raw_names (g_ptr_array_index (shard_set->shards, i));
+    if (!cursor_load (iter, &cursor))
+      continue;
+
+    g_array_append_val (iter->heap, cursor);
+    heap_sift_up (iter, iter->heap->len - 1);
+  }
+
+  return iter;
+}
+
+static void
+eos_shard_shard_set_iter_free (EosShardShardSetIter *iter)
+{
+  g_object_unref (iter->shard_set);
+  g_array_unref (iter->heap);
+  g_free (iter);
+}
+
+EosShardShardSetIter *
+eos_shard_shard_set_iter_ref (EosShardShardSetIter *iter)
+{
+  iter->ref_count++;
+  return iter;
+}
+
+void
+eos_shard_shard_set_iter_unref (EosShardShardSetIter *iter)
+{
+  if (--iter->ref_count == 0)
+    eos_shard_shard_set_iter_free (iter);
+}
+
+/**
+ * eos_shard_shard_set_iter_next:
+ * @iter: the iterator
+ *
+ * Returns: (transfer full): the next #EosShardRecord, or %NULL once there
+ *   are no more
+ */
+EosShardRecord *
+eos_shard_shard_set_iter_next (EosShardShardSetIter *iter)
+{
+  while (iter->heap->len > 0) {
+    struct merge_cursor top = *HEAP_CURSOR (iter, 0);
+    heap_advance_top (iter);
+
+    /* Anything else with the same name is in a lower priority shard. */
+    while (iter->heap->len > 0 &&
+           memcmp (HEAP_CURSOR (iter, 0)->raw_name, top.raw_name, EOS_SHARD_RAW_NAME_SIZE) == 0)
+      heap_advance_top (iter);
+
+    if (top.tombstone)
+      continue;
+
+    EosShardShardFile *shard_file = g_ptr_array_index (iter->shard_set->shards, top.shard_idx);
+    EosShardRecord *record = eos_shard_shard_file_find_record_by_raw_name (shard_file, (uint8_t *) top.raw_name);
+    if (record != NULL)
+      return record;
+  }
+
+  return NULL;
+}
+
+G_DEFINE_BOXED_TYPE (EosShardShardSetIter, eos_shard_shard_set_iter,
+                     eos_shard_shard_set_iter_ref, eos_shard_shard_set_iter_unref)
@@ -0,0 +1,53 @@
+/* Copyright 2015 Endless Mobile, Inc. */
+
+/* This file is part of eos-shard.
+ *
+ * eos-shard is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * eos-shard is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with eos-shard.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <gio/gio.h>
+#include <stdint.h>
+
+#include "eos-shard-types.h"
+#include "eos-shard-shard-file.h"
+
+/**
+ * EosShardShardSet:
+ *
+ * A stack of shard files, layered in priority order. Lookups are answered
+ * by the highest priority shard that has the record, and tombstones in a
+ * shard hide the record in all the shards below it.
+ */
+
+#define EOS_SHARD_TYPE_SHARD_SET (eos_shard_shard_set_get_type ())
+G_DECLARE_FINAL_TYPE (EosShardShardSet, eos_shard_shard_set, EOS_SHARD, SHARD_SET, GObject)
+
+EosShardShardSet * eos_shard_shard_set_new (GList *shard_files);
+
+EosShardRecord * eos_shard_shard_set_find_record_by_raw_name (EosShardShardSet *self, uint8_t *raw_name);
+EosShardRecord * eos_shard_shard_set_find_record_by_hex_name (EosShardShardSet *self, const char *hex_name);
+
+GPtrArray * _eos_shard_shard_set_get_shards (EosShardShardSet *self);
+
+GType eos_shard_shard_set_iter_get_type (void) G_GNUC_CONST;
+
+EosShardShardSetIter * eos_shard_shard_set_iter_new (EosShardShardSet *shard_set);
+EosShardShardSetIter * eos_shard_shard_set_iter_ref (EosShardShardSetIter *iter);
+void eos_shard_shard_set_iter_unref (EosShardShardSetIter *iter);
+EosShardRecord * eos_shard_shard_set_iter_next (EosShardShardSetIter *iter);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (EosShardShardSetIter, eos_shard_shard_set_iter_unref)
@@ -22,4 +22,6 @@
 typedef struct _EosShardRecord EosShardRecord;
 typedef struct _EosShardBlob EosShardBlob;
 typedef struct _EosShardDictionary EosShardDictionary;
+typedef struct _EosShardDictionaryIter EosShardDictionaryIter;
 typedef struct _EosShardDictionaryWriter EosShardDictionaryWriter;
+typedef struct _EosShardShardSetIter EosShardShardSetIter;
@@ -23,7 +23,9 @@
 
 #include <fcntl.h>
 #include <string.h>
+#include <zstd.h>
 
+#include "eos-shard-blob.h"
 #include "eos-shard-shard-file.h"
 
 #define ALIGN(n) (((n) + 0x3f) & ~0x3f)
@@ -58,11 +60,21 @@ struct _EosShardWriterV1
 {
   GObject parent;
 
+  int zstd_level;
   GArray *entries;
 };
 
 G_DEFINE_TYPE (EosShardWriterV1, eos_shard_writer_v1, G_TYPE_OBJECT);
 
+enum
+{
+  PROP_0,
+  PROP_ZSTD_LEVEL,
+  LAST_PROP,
+};
+
+static GParamSpec *obj_props[LAST_PROP] = { NULL, };
+
 static void
 eos_shard_writer_v1_finalize (GObject *object)
 {
@@ -85,6 +97,42 @@ eos_shard_writer_v1_record_entry_clear (struct eos_shard_writer_v1_record_entry
   eos_shard_writer_v1_blob_entry_clear (&entry->data);
 }
 
+static void
+eos_shard_writer_v1_set_property (GObject      *object,
+                                  guint         prop_id,
+                                  const GValue *value,
+                                  GParamSpec   *pspec)
+{
+  EosShardWriterV1 *self = EOS_SHARD_WRITER_V1 (object);
+
+  switch (prop_id) {
+  case PROP_ZSTD_LEVEL:
+    self->zstd_level = g_value_get_int (value);
+    break;
+
+  default:
+    G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+  }
+}
+
+static void
+eos_shard_writer_v1_get_property (GObject    *object,
+                                  guint       prop_id,
+                                  GValue     *value,
+                                  GParamSpec *pspec)
+{
+  EosShardWriterV1 *self = EOS_SHARD_WRITER_V1 (object);
+
+  switch (prop_id) {
+  case PROP_ZSTD_LEVEL:
+    g_value_set_int (value, self->zstd_level);
+    break;
+
+  default:
+    G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+  }
+}
+
 static void
 eos_shard_writer_v1_class_init (EosShardWriterV1Class *klass)
 {
@@ -92,11 +140,27 @@ eos_shard_writer_v1_class_init (EosShardWriterV1Class *klass)
 
   gobject_class = G_OBJECT_CLASS (klass);
   gobject_class->finalize = eos_shard_writer_v1_finalize;
+  gobject_class->set_property = eos_shard_writer_v1_set_property;
+  gobject_class->get_property = eos_shard_writer_v1_get_property;
+
+  /**
+   * EosShardWriterV1:zstd-level:
+   *
+   * The compression level used for blobs added with
+   * %EOS_SHARD_BLOB_FLAG_COMPRESSED_ZSTD.
+   */
+  obj_props[PROP_ZSTD_LEVEL] =
+    g_param_spec_int ("zstd-level", "", "", ZSTD_minCLevel (), ZSTD_maxCLevel (), ZSTD_CLEVEL_DEFAULT,
+                      (GParamFlags) (G_PARAM_READWRITE |
+                                     G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_properties (gobject_class, LAST_PROP, obj_props);
 }
 
 static void
 eos_shard_writer_v1_init (EosShardWriterV1 *self)
 {
+  self->zstd_level = ZSTD_CLEVEL_DEFAULT;
   self->entries = g_array_new (FALSE, TRUE, sizeof (struct eos_shard_writer_v1_record_entry));
   g_array_set_clear_func (self->entries, (GDestroyNotify) eos_shard_writer_v1_record_entry_clear);
 }
@@ -170,6 +234,9 @@ eos_shard_writer_v1_add_blob (EosShardWriterV1 *self,
   struct eos_shard_writer_v1_record_entry *e = &g_array_index (self->entries, struct eos_shard_writer_v1_record_entry, self->entries->len - 1);
   struct eos_shard_writer_v1_blob_entry *b = get_blob_entry (e, which_blob);
 
+  /* Chunked blobs are only supported in V2 shards. */
+  g_return_if_fail (!(flags & EOS_SHARD_BLOB_FLAG_CHUNKED));
+
   b->file = g_object_ref (file);
   b->flags = flags;
 
@@ -182,7 +249,7 @@ eos_shard_writer_v1_add_blob (EosShardWriterV1 *self,
 }
 
 static void
-write_blob (int fd, struct eos_shard_writer_v1_blob_entry *blob)
+write_blob (int fd, struct eos_shard_writer_v1_blob_entry *blob, int zstd_level)
 {
   g_autoptr(GError) error = NULL;
 
@@ -197,9 +264,9 @@ write_blob (int fd, struct eos_shard_writer_v1_blob_entry *blob)
 
   g_autoptr(GInputStream) stream = NULL;
 
-  if (blob->flags & EOS_SHARD_BLOB_FLAG_COMPRESSED_ZLIB) {
-    g_autoptr(GZlibCompressor) compressor = g_zlib_compressor_new (G_ZLIB_COMPRESSOR_FORMAT_ZLIB, -1);
-    stream = g_converter_input_stream_new (G_INPUT_STREAM (file_stream), G_CONVERTER (compressor));
+  g_autoptr(GConverter) compressor = _eos_shard_new_compressor_for_flags (blob->flags, zstd_level);
+  if (compressor != NULL) {
+    stream = g_converter_input_stream_new (G_INPUT_STREAM (file_stream), compressor);
     g_object_unref (file_stream);
   } else {
     stream = G_INPUT_STREAM (file_stream);
@@ -299,8 +366,8 @@ eos_shard_writer_v1_write_to_fd (EosShardWriterV1 *self, int fd)
   for (i = 0; i < self->entries->len; i++) {
     struct eos_shard_writer_v1_record_entry *e = &g_array_index (self->entries, struct eos_shard_writer_v1_record_entry, i);
 
-    write_blob (fd, &e->metadata);
-    write_blob (fd, &e->data);
+    write_blob (fd, &e->metadata, self->zstd_level);
+    write_blob (fd, &e->data, self->zstd_level);
   }
 
   lseek (fd, 0, SEEK_SET);
@@ -26,14 +26,22 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
 #include <gio/gfiledescriptorbased.h>
 #include <gio/gunixinputstream.h>
+#include <zdict.h>
+#include <zstd.h>
 
+#include "eos-shard-blob.h"
+#include "eos-shard-bloom-filter.h"
+#include "eos-shard-codec.h"
+#include "eos-shard-record.h"
 #include "eos-shard-shard-file.h"
+#include "eos-shard-zstd-converter.h"
 #include "eos-shard-format-v2.h"
 
 /* Rounds up n to the nearest m -- m must be a power of two. */
@@ -41,6 +49,12 @@
 
 #define ALIGN(n) _ALIGN(n, 0x20)
 
+/* zstd's own default for dictionary sizes. */
+#define DEFAULT_ZSTD_DICTIONARY_SIZE (110 * 1024)
+
+/* About 10 bits per record. */
+#define RECORD_FILTER_FALSE_POSITIVE_RATE 0.01
+
 struct eos_shard_writer_v2_blob_entry
 {
   /* Offset to where the sblob is placed in the file... */
@@ -53,6 +67,7 @@ struct eos_shard_writer_v2_blob_entry
 struct eos_shard_writer_v2_record_entry
 {
   uint8_t raw_name[EOS_SHARD_RAW_NAME_SIZE];
+  uint32_t flags;
   GArray *blobs;
 
   off_t blob_table_start;
@@ -76,6 +91,8 @@ enum
 {
   PROP_0,
   PROP_FD,
+  PROP_ZSTD_LEVEL,
+  PROP_RECORD_FILTER,
   LAST_PROP,
 };
 
@@ -85,6 +102,9 @@ struct _EosShardWriterV2
 {
   GObject parent;
 
+  int zstd_level;
+  gboolean record_filter;
+
   /* This lock applies to the members below. */
   GMutex lock;
 
@@ -92,7 +112,27 @@ struct _EosShardWriterV2
   GPtrArray *blobs;
   GArray *records;
   GHashTable *csum_to_data_start;
+  /* Checksums whose data is being written right now, but isn't in
+   * csum_to_data_start yet. pending_cond is signalled as they finish. */
+  GHashTable *csum_pending;
+  GCond pending_cond;
   struct constant_pool cpool;
+
+  /* Set once a dictionary has been trained, see
+   * eos_shard_writer_v2_train_zstd_dictionary(). */
+  ZSTD_CDict *zstd_cdict;
+  off_t zstd_dictionary_start;
+  size_t zstd_dictionary_size;
+
+  /* The parallel ingestion pipeline. This lock applies to the members below. */
+  GMutex ingest_lock;
+  GCond ingest_cond;
+  GThreadPool *ingest_pool;
+  guint ingest_max_in_flight;
+  guint ingest_in_flight;
+  /* Submitted jobs, in order, that haven't been written out yet. */
+  GQueue ingest_queue;
+  gboolean ingest_writing;
 };
 
 G_DEFINE_TYPE (EosShardWriterV2, eos_shard_writer_v2, G_TYPE_OBJECT);
@@ -163,10 +203,19 @@ static void
 eos_shard_writer_v2_finalize (GObject *object)
 {
   EosShardWriterV2 *self = EOS_SHARD_WRITER_V2 (object);
+
+  if (self->ingest_pool != NULL)
+    g_thread_pool_free (self->ingest_pool, FALSE, TRUE);
+  g_mutex_clear (&self->ingest_lock);
+  g_cond_clear (&self->ingest_cond);
+
   constant_pool_dispose (&self->cpool);
   g_ptr_array_unref (self->blobs);
   g_array_unref (self->records);
   g_hash_table_unref (self->csum_to_data_start);
+  g_hash_table_unref (self->csum_pending);
+  g_cond_clear (&self->pending_cond);
+  ZSTD_freeCDict (self->zstd_cdict);
   G_OBJECT_CLASS (eos_shard_writer_v2_parent_class)->finalize (object);
 }
 
@@ -214,6 +263,14 @@ eos_shard_writer_v2_set_property (GObject      *object,
     open_write_context (&self->ctx, g_value_get_uint64 (value));
     break;
 
+  case PROP_ZSTD_LEVEL:
+    self->zstd_level = g_value_get_int (value);
+    break;
+
+  case PROP_RECORD_FILTER:
+    self->record_filter = g_value_get_boolean (value);
+    break;
+
   default:
     G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
   }
@@ -232,6 +289,14 @@ eos_shard_writer_v2_get_property (GObject    *object,
     g_value_set_uint64 (value, self->ctx.fd);
     break;
 
+  case PROP_ZSTD_LEVEL:
+    g_value_set_int (value, self->zstd_level);
+    break;
+
+  case PROP_RECORD_FILTER:
+    g_value_set_boolean (value, self->record_filter);
+    break;
+
   default:
     G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
   }
@@ -253,6 +318,30 @@ eos_shard_writer_v2_class_init (EosShardWriterV2Class *klass)
                                         G_PARAM_CONSTRUCT_ONLY |
                                         G_PARAM_STATIC_STRINGS));
 
+  /**
+   * EosShardWriterV2:zstd-level:
+   *
+   * The compression level used for blobs added with
+   * %EOS_SHARD_BLOB_FLAG_COMPRESSED_ZSTD.
+   */
+  obj_props[PROP_ZSTD_LEVEL] =
+    g_param_spec_int ("zstd-level", "", "", ZSTD_minCLevel (), ZSTD_maxCLevel (), ZSTD_CLEVEL_DEFAULT,
+                      (GParamFlags) (G_PARAM_READWRITE |
+                                     G_PARAM_STATIC_STRINGS));
+
+  /**
+   * EosShardWriterV2:record-filter:
+   *
+   * Whether to write a bloom filter over the record names, which lets
+   * readers answer most lookups for records not in the shard without
+   * searching the record table. This is worthwhile for shards layered in
+   * an #EosShardShardSet, where most lookups miss.
+   */
+  obj_props[PROP_RECORD_FILTER] =
+    g_param_spec_boolean ("record-filter", "", "", FALSE,
+                          (GParamFlags) (G_PARAM_READWRITE |
+                                         G_PARAM_STATIC_STRINGS));
+
   g_object_class_install_properties (gobject_class, LAST_PROP, obj_props);
 }
 
@@ -260,6 +349,11 @@ static void
 eos_shard_writer_v2_init (EosShardWriterV2 *self)
 {
   g_mutex_init (&self->lock);
+  g_mutex_init (&self->ingest_lock);
+  g_cond_init (&self->ingest_cond);
+  g_queue_init (&self->ingest_queue);
+
+  self->zstd_level = ZSTD_CLEVEL_DEFAULT;
 
   constant_pool_init (&self->cpool);
 
@@ -269,6 +363,8 @@ eos_shard_writer_v2_init (EosShardWriterV2 *self)
   g_array_set_clear_func (self->records, (GDestroyNotify) eos_shard_writer_v2_record_entry_clear);
 
   self->csum_to_data_start = g_hash_table_new (csum_hash, csum_equal);
+  self->csum_pending = g_hash_table_new (csum_hash, csum_equal);
+  g_cond_init (&self->pending_cond);
 }
 
 /**
@@ -282,53 +378,229 @@ eos_shard_writer_v2_new_for_fd (int fd)
   return EOS_SHARD_WRITER_V2 (g_object_new (EOS_SHARD_TYPE_WRITER_V2, "fd", fd, NULL));
 }
 
+/* The packed contents of a blob, ready to be written into the shard. */
+struct packed_blob_data
+{
+  /* Small compressed contents are held in memory... */
+  GBytes *bytes;
+  /* ... while uncompressed contents are copied straight from the source
+   * file, and large compressed contents from an anonymous file. */
+  int fd;
+  /* Blobs taken from another shard are copied from there as they are. */
+  EosShardBlob *source;
+};
+
+/* Packed contents bigger than this are moved out of memory. */
+#define PACKED_SPILL_THRESHOLD (8 * 1024 * 1024)
+
+/* Collects a blob's packed contents as they are produced. They start out
+ * in memory, and move to an anonymous file once they pass
+ * PACKED_SPILL_THRESHOLD, so that blobs in flight in the ingestion
+ * pipeline don't each hold a large blob in RAM, and so that packed
+ * contents aren't limited by the guint size of a GByteArray. */
+struct packed_output
+{
+  GByteArray *array;
+  int fd;
+  uint64_t size;
+};
+
 static int
-compress_blob_to_tmp (GInputStream *file_stream)
+open_spill_fd (void)
 {
-  char tmpl[] = "/tmp/shardXXXXXX";
-  int fd = mkstemp (tmpl);
-  unlink (tmpl);
+  int fd = -1;
 
-  /* Compress the given GInputStream to the tmpfile. */
+#ifdef HAVE_MEMFD_CREATE
+  fd = memfd_create ("eos-shard-blob", MFD_CLOEXEC);
+#endif
 
-  g_autoptr(GZlibCompressor) compressor = g_zlib_compressor_new (G_ZLIB_COMPRESSOR_FORMAT_ZLIB, -1);
-  g_autoptr(GInputStream) stream = g_converter_input_stream_new (G_INPUT_STREAM (file_stream), G_CONVERTER (compressor));
+  if (fd < 0) {
+    g_autoptr(GError) error = NULL;
+    g_autofree char *path = NULL;
 
-  uint8_t buf[4096*4];
-  int size;
-  while ((size = g_input_stream_read (stream, buf, sizeof (buf), NULL, NULL)) != 0) {
-    g_assert (write (fd, buf, size) >= 0);
+    fd = g_file_open_tmp ("eos-shard-blob-XXXXXX", &path, &error);
+    if (fd < 0)
+      g_error ("Could not create a file for blob data: %s", error->message);
+    unlink (path);
   }
 
   return fd;
 }
 
-/**
- * eos_shard_writer_v2_add_blob:
- * @self: an #EosShardWriterV2
- * @name: the name of the blob to store.
- * @file: a file of contents to write into the shard
- * @content_type: (allow-none): The MIME type of the blob. Pass %NULL to
- *   autodetect using Gio.
- * @flags: flags about how the data should be stored in the file
- *
- * Adds the blob at the specified file path to the shard.
- *
- * Returns some opaque identifier for the blob, to be passed to
- * eos_shard_writer_v2_add_blob_to_record().
- */
-uint64_t
-eos_shard_writer_v2_add_blob (EosShardWriterV2  *self,
-                              char              *name,
-                              GFile             *file,
-                              char              *content_type,
-                              EosShardBlobFlags  flags)
+static void
+spill_pwrite (int fd, const uint8_t *buf, gsize count, off_t offset)
+{
+  while (count > 0) {
+    ssize_t written = pwrite (fd, buf, count, offset);
+    if (written < 0 && errno == EINTR)
+      continue;
+    if (written < 0)
+      g_error ("Could not write blob data: %s", strerror (errno));
+    buf += written;
+    offset += written;
+    count -= written;
+  }
+}
+
+static void
+packed_output_init (struct packed_output *out, uint64_t size_hint)
+{
+  out->array = g_byte_array_sized_new (MIN (size_hint, PACKED_SPILL_THRESHOLD));
+  out->fd = -1;
+  out->size = 0;
+}
+
+static void
+packed_output_append (struct packed_output *out, const void *buf, gsize count)
+{
+  if (out->fd < 0 && out->size + count > PACKED_SPILL_THRESHOLD) {
+    out->fd = open_spill_fd ();
+    spill_pwrite (out->fd, out->array->data, out->array->len, 0);
+    g_clear_pointer (&out->array, g_byte_array_unref);
+  }
+
+  if (out->fd >= 0)
+    spill_pwrite (out->fd, buf, count, out->size);
+  else
+    g_byte_array_append (out->array, buf, count);
+
+  out->size += count;
+}
+
+/* Overwrites part of what was already appended. */
+static void
+packed_output_write_at (struct packed_output *out, const void *buf, gsize count, uint64_t offset)
+{
+  if (out->fd >= 0)
+    spill_pwrite (out->fd, buf, count, offset);
+  else
+    memcpy (out->array->data + offset, buf, count);
+}
+
+static void
+packed_output_update_checksum (struct packed_output *out, GChecksum *checksum)
+{
+  if (out->fd < 0) {
+    g_checksum_update (checksum, out->array->data, out->array->len);
+    return;
+  }
+
+  uint8_t buf[4096*4];
+  uint64_t offset = 0;
+  while (offset < out->size) {
+    ssize_t size = pread (out->fd, buf, MIN (sizeof (buf), out->size - offset), offset);
+    if (size < 0 && errno == EINTR)
+      continue;
+    if (size <= 0)
+      g_error ("Could not read back blob data: %s", size < 0 ? strerror (errno) : "unexpected end of file");
+    g_checksum_update (checksum, buf, size);
+    offset += size;
+  }
+}
+
+/* Hands the collected contents over to @data, and returns their size. */
+static uint64_t
+packed_output_finish (struct packed_output *out, struct packed_blob_data *data)
+{
+  if (out->fd >= 0)
+    data->fd = out->fd;
+  else
+    data->bytes = g_byte_array_free_to_bytes (out->array);
+
+  out->array = NULL;
+  out->fd = -1;
+  return out->size;
+}
+
+/* Compresses the given GInputStream into @data, checksumming the
+ * compressed bytes as they are produced. Returns the compressed size. */
+static uint64_t
+compress_blob (GInputStream            *file_stream,
+               GConverter              *compressor,
+               uint64_t                 size_hint,
+               GChecksum               *checksum,
+               struct packed_blob_data *data)
+{
+  g_autoptr(GInputStream) stream = g_converter_input_stream_new (G_INPUT_STREAM (file_stream), compressor);
+  g_autoptr(GError) error = NULL;
+  struct packed_output out;
+
+  /* Most of our content compresses to well under half its size. */
+  packed_output_init (&out, size_hint / 2 + 1);
+
+  uint8_t buf[4096*4];
+  gssize size;
+  while ((size = g_input_stream_read (stream, buf, sizeof (buf), NULL, &error)) > 0) {
+    g_checksum_update (checksum, buf, size);
+    packed_output_append (&out, buf, size);
+  }
+
+  if (size < 0)
+    g_error ("Could not compress blob data: %s", error->message);
+
+  return packed_output_finish (&out, data);
+}
+
+/* Splits the given GInputStream into chunks, compresses each one on its
+ * own, and lays them out in @data behind a chunk table. Returns the
+ * packed size. */
+static uint64_t
+chunk_blob (GInputStream            *file_stream,
+            EosShardBlobFlags        flags,
+            int                      zstd_level,
+            const ZSTD_CDict        *cdict,
+            uint64_t                 uncompressed_size,
+            GChecksum               *checksum,
+            struct packed_blob_data *data)
+{
+  uint32_t n_chunks = (uncompressed_size + CHUNKED_BLOB_CHUNK_SIZE - 1) / CHUNKED_BLOB_CHUNK_SIZE;
+  gsize table_size = chunk_table_size (n_chunks);
+  g_autofree uint64_t *offsets = g_new (uint64_t, n_chunks + 1);
+  g_autofree uint8_t *buf = g_malloc (CHUNKED_BLOB_CHUNK_SIZE);
+  struct packed_output out;
+  uint32_t i;
+
+  packed_output_init (&out, table_size + uncompressed_size / 2);
+
+  /* Leave room for the table, and fill it in once we know the offsets. */
+  g_autofree uint8_t *table = g_malloc0 (table_size);
+  packed_output_append (&out, table, table_size);
+
+  for (i = 0; i < n_chunks; i++) {
+    g_autoptr(GError) error = NULL;
+    gsize expected = MIN (CHUNKED_BLOB_CHUNK_SIZE, uncompressed_size - (uint64_t) i * CHUNKED_BLOB_CHUNK_SIZE);
+    gsize size;
+
+    if (!g_input_stream_read_all (file_stream, buf, expected, &size, NULL, &error))
+      g_error ("Could not read blob data: %s", error->message);
+    g_assert (size == expected);
+
+    g_autoptr(GBytes) chunk = codec_encode (flags, zstd_level, cdict, buf, size, &error);
+    if (chunk == NULL)
+      g_error ("Could not compress blob data: %s", error->message);
+
+    offsets[i] = out.size;
+    packed_output_append (&out, g_bytes_get_data (chunk, NULL), g_bytes_get_size (chunk));
+  }
+
+  offsets[n_chunks] = out.size;
+  chunk_table_write (table, CHUNKED_BLOB_CHUNK_SIZE, n_chunks, offsets);
+  packed_output_write_at (&out, table, table_size, 0);
+
+  packed_output_update_checksum (&out, checksum);
+  return packed_output_finish (&out, data);
+}
+
+static struct eos_shard_writer_v2_blob_entry *
+blob_entry_new (EosShardWriterV2  *self,
+                char              *name,
+                GFile             *file,
+                char              *content_type,
+                EosShardBlobFlags  flags)
 {
   struct eos_shard_writer_v2_blob_entry b = {};
   g_autoptr(GFileInfo) info = NULL;
 
-  b.name = g_strdup (name);
-
   if (content_type == NULL) {
     info = g_file_query_info (file, "standard::size,standard::content-type", 0, NULL, NULL);
     content_type = (char *) g_file_info_get_content_type (info);
@@ -336,10 +608,13 @@ eos_shard_writer_v2_add_blob (EosShardWriterV2  *self,
     info = g_file_query_info (file, "standard::size", 0, NULL, NULL);
   }
 
-  g_return_val_if_fail (strlen (name) <= EOS_SHARD_V2_BLOB_MAX_NAME_SIZE, 0);
-  g_return_val_if_fail (strlen (content_type) <= EOS_SHARD_V2_BLOB_MAX_CONTENT_TYPE_SIZE, 0);
+  g_return_val_if_fail (strlen (name) <= EOS_SHARD_V2_BLOB_MAX_NAME_SIZE, NULL);
+  g_return_val_if_fail (strlen (content_type) <= EOS_SHARD_V2_BLOB_MAX_CONTENT_TYPE_SIZE, NULL);
 
+  b.name = g_strdup (name);
   b.sblob.flags = flags;
+  if (self->zstd_cdict != NULL && (flags & EOS_SHARD_BLOB_FLAG_COMPRESSED_ZSTD))
+    b.sblob.flags |= EOS_SHARD_V2_BLOB_FLAG_ZSTD_DICTIONARY;
   b.sblob.uncompressed_size = g_file_info_get_size (info);
 
   /* Lock around the cpool. */
@@ -348,78 +623,662 @@ eos_shard_writer_v2_add_blob (EosShardWriterV2  *self,
   b.sblob.content_type_offs = constant_pool_add (&self->cpool, content_type);
   g_mutex_unlock (&self->lock);
 
-  /* Now deal with blob contents. */
+  return g_memdup (&b, sizeof (b));
+}
 
+static uint64_t
+append_blob_entry (EosShardWriterV2 *self, struct eos_shard_writer_v2_blob_entry *blob)
+{
+  g_mutex_lock (&self->lock);
+  g_ptr_array_add (self->blobs, blob);
+  uint64_t index = self->blobs->len - 1;
+  g_mutex_unlock (&self->lock);
+  return index;
+}
+
+/* Produces the packed (possibly compressed) contents of the blob in a
+ * single pass over the source, and fills in its size and checksum. This
+ * doesn't touch the writer, so it is safe to run on any thread. */
+static void
+prepare_blob_data (struct eos_shard_writer_v2_blob_entry *blob,
+                   GFile                                 *file,
+                   int                                    zstd_level,
+                   const ZSTD_CDict                      *zstd_cdict,
+                   struct packed_blob_data               *data)
+{
   g_autoptr(GError) error = NULL;
-  GFileInputStream *file_stream = g_file_read (file, NULL, &error);
+  g_autoptr(GFileInputStream) file_stream = g_file_read (file, NULL, &error);
   if (!file_stream) {
     g_error ("Could not read from %s: %s", g_file_get_path (file), error->message);
-    return -1;
+    return;
   }
 
-  int blob_fd;
-  if (b.sblob.flags & EOS_SHARD_BLOB_FLAG_COMPRESSED_ZLIB) {
-    blob_fd = compress_blob_to_tmp (G_INPUT_STREAM (file_stream));
+  g_autoptr(GChecksum) checksum = g_checksum_new (G_CHECKSUM_SHA256);
+  uint64_t blob_size;
+
+  data->bytes = NULL;
+  data->fd = -1;
+  data->source = NULL;
+
+  const ZSTD_CDict *cdict = NULL;
+  if (blob->sblob.flags & EOS_SHARD_V2_BLOB_FLAG_ZSTD_DICTIONARY)
+    cdict = zstd_cdict;
+
+  g_autoptr(GConverter) compressor = NULL;
+  if (cdict != NULL)
+    compressor = G_CONVERTER (_eos_shard_zstd_converter_new_compressor (zstd_level, cdict));
+  else
+    compressor = _eos_shard_new_compressor_for_flags (blob->sblob.flags, zstd_level);
+
+  if (blob->sblob.flags & EOS_SHARD_BLOB_FLAG_CHUNKED) {
+    blob_size = chunk_blob (G_INPUT_STREAM (file_stream), blob->sblob.flags, zstd_level, cdict,
+                            blob->sblob.uncompressed_size, checksum, data);
+  } else if (compressor != NULL) {
+    blob_size = compress_blob (G_INPUT_STREAM (file_stream), compressor, blob->sblob.uncompressed_size, checksum, data);
   } else {
-    blob_fd = g_file_descriptor_based_get_fd (G_FILE_DESCRIPTOR_BASED (file_stream));
+    /* Keep our own fd around for the copy, since the stream closes its own. */
+    int fd = g_file_descriptor_based_get_fd (G_FILE_DESCRIPTOR_BASED (file_stream));
+    data->fd = dup (fd);
+    g_assert (data->fd >= 0);
+
+    uint8_t buf[4096*4];
+    int size;
+    blob_size = 0;
+    while ((size = read (data->fd, buf, sizeof (buf))) != 0) {
+      g_assert (size > 0);
+      g_checksum_update (checksum, buf, size);
+      blob_size += size;
+    }
   }
 
-  /* Find the size by seeking... */
-  uint64_t blob_size = lseek (blob_fd, 0, SEEK_END);
-  g_assert (blob_size >= 0);
-  g_assert (lseek (blob_fd, 0, SEEK_SET) >= 0);
+  size_t checksum_buf_len = sizeof (blob->sblob.csum);
+  g_checksum_get_digest (checksum, blob->sblob.csum, &checksum_buf_len);
+  g_assert (checksum_buf_len == sizeof (blob->sblob.csum));
+
+  blob->sblob.size = blob_size;
+}
+
+static void
+packed_blob_data_clear (struct packed_blob_data *data)
+{
+  g_clear_pointer (&data->bytes, g_bytes_unref);
+  g_clear_pointer (&data->source, eos_shard_blob_unref);
+  if (data->fd >= 0) {
+    g_assert (close (data->fd) == 0 || errno == EINTR);
+    data->fd = -1;
+  }
+}
+
+/* Copies a blob's packed data from the shard it came from. Unlike our own
+ * files, the source shard may be truncated or unreadable, so this reports
+ * errors instead of asserting. */
+static gboolean
+copy_source_blob_data (int shard_fd, off_t offset, EosShardBlob *source, GError **error)
+{
+  EosShardShardFile *source_file = source->shard_file;
+  gsize remaining = source->size;
+  off_t in_offset = source->offs;
+
+  /* Let the kernel copy the range, sharing extents where it can. Copies
+   * across filesystems, or on kernels without copy_file_range(), fall
+   * back to reading and writing it ourselves. */
+  while (remaining > 0) {
+    gssize size = _eos_shard_shard_file_copy_data (source_file, shard_fd, offset, remaining, in_offset);
+    if (size < 0 && errno == EINTR)
+      continue;
+    if (size < 0 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP))
+      break;
+    if (size < 0) {
+      int copy_error = errno;
+      g_set_error (error, G_IO_ERROR, g_io_error_from_errno (copy_error),
+                   "Could not copy blob data: %s", strerror (copy_error));
+      return FALSE;
+    }
+    if (size == 0)
+      goto truncated;
+    in_offset += size;
+    offset += size;
+    remaining -= size;
+  }
 
-  /* Checksum the blob. */
-  g_autoptr(GChecksum) checksum = g_checksum_new (G_CHECKSUM_SHA256);
   uint8_t buf[4096*4];
-  int size;
-  while ((size = read (blob_fd, buf, sizeof (buf))) != 0)
-    g_checksum_update (checksum, buf, size);
+  while (remaining > 0) {
+    gssize size = _eos_shard_shard_file_read_data (source_file, buf, MIN (sizeof (buf), remaining), in_offset);
+    if (size < 0 && errno == EINTR)
+      continue;
+    if (size < 0) {
+      int read_error = errno;
+      g_set_error (error, EOS_SHARD_ERROR, EOS_SHARD_ERROR_BLOB_STREAM_READ,
+                   "Read failed: %s", strerror (read_error));
+      return FALSE;
+    }
+    if (size == 0)
+      goto truncated;
+
+    gssize written = 0;
+    while (written < size) {
+      gssize n = pwrite (shard_fd, buf + written, size - written, offset + written);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n < 0) {
+        int write_error = errno;
+        g_set_error (error, G_IO_ERROR, g_io_error_from_errno (write_error),
+                     "Could not write blob data: %s", strerror (write_error));
+        return FALSE;
+      }
+      written += n;
+    }
 
-  size_t checksum_buf_len = sizeof (b.sblob.csum);
-  g_checksum_get_digest (checksum, b.sblob.csum, &checksum_buf_len);
-  g_assert (checksum_buf_len == sizeof (b.sblob.csum));
+    in_offset += size;
+    offset += size;
+    remaining -= size;
+  }
+
+  return TRUE;
 
-  /* Add the blob entry to the file. */
+ truncated:
+  g_set_error (error, EOS_SHARD_ERROR, EOS_SHARD_ERROR_BLOB_STREAM_READ,
+               "Read failed: source blob is truncated");
+  return FALSE;
+}
+
+static gboolean
+write_packed_blob_data (int shard_fd, off_t offset, struct packed_blob_data *data, GError **error)
+{
+  if (data->bytes != NULL) {
+    gsize size;
+    const uint8_t *buf = g_bytes_get_data (data->bytes, &size);
+    while (size > 0) {
+      ssize_t written = pwrite (shard_fd, buf, size, offset);
+      g_assert (written >= 0);
+      buf += written;
+      offset += written;
+      size -= written;
+    }
+  } else if (data->source != NULL) {
+    return copy_source_blob_data (shard_fd, offset, data->source, error);
+  } else {
+    uint8_t buf[4096*4];
+    int size;
+    off_t in_offset = 0;
+    while ((size = pread (data->fd, buf, sizeof (buf), in_offset)) != 0) {
+      g_assert (size > 0);
+      g_assert (pwrite (shard_fd, buf, size, offset) == size);
+      in_offset += size;
+      offset += size;
+    }
+  }
+
+  return TRUE;
+}
+
+/* Places the packed blob data in the shard, unless identical data is
+ * already there, and releases @data. Only data copied from another shard
+ * can fail to be written. Data is only shared with other blobs once it
+ * has been written; blobs with the same checksum wait for a write in
+ * progress, and write their own data if it fails. */
+static gboolean
+commit_blob_data (EosShardWriterV2 *self, struct eos_shard_writer_v2_blob_entry *blob, struct packed_blob_data *data, GError **error)
+{
   g_mutex_lock (&self->lock);
 
-  /* Look for a checksum in our table to return early if we have it... */
-  off_t data_start = GPOINTER_TO_UINT (g_hash_table_lookup (self->csum_to_data_start, &b.sblob.csum));
+  while (g_hash_table_contains (self->csum_pending, &blob->sblob.csum))
+    g_cond_wait (&self->pending_cond, &self->lock);
 
-  struct eos_shard_writer_v2_blob_entry *blob = g_memdup (&b, sizeof (b));
-  g_ptr_array_add (self->blobs, blob);
-  uint64_t index = self->blobs->len - 1;
+  /* Look for a checksum in our table to return early if we have it... */
+  off_t data_start = GPOINTER_TO_UINT (g_hash_table_lookup (self->csum_to_data_start, &blob->sblob.csum));
 
   /* If the blob data isn't already in the file, write it in. */
   if (data_start == 0) {
-    /* Position the blob in the file, and add it to the csum table. */
+    /* Position the blob in the file, and mark it as being written. */
     int shard_fd = self->ctx.fd;
     data_start = self->ctx.offset;
-    self->ctx.offset = ALIGN (self->ctx.offset + blob_size);
-    g_hash_table_insert (self->csum_to_data_start, &blob->sblob.csum, GUINT_TO_POINTER (data_start));
+    self->ctx.offset = ALIGN (self->ctx.offset + blob->sblob.size);
+    g_hash_table_add (self->csum_pending, &blob->sblob.csum);
 
     /* Unlock before writing data to the file. */
     g_mutex_unlock (&self->lock);
 
-    off_t offset = data_start;
+    gboolean written = write_packed_blob_data (shard_fd, data_start, data, error);
 
-    lseek (blob_fd, 0, SEEK_SET);
-    while ((size = read (blob_fd, buf, sizeof (buf))) != 0) {
-      g_assert (pwrite (shard_fd, buf, size, offset) >= 0);
-      offset += size;
+    g_mutex_lock (&self->lock);
+    g_hash_table_remove (self->csum_pending, &blob->sblob.csum);
+    if (written)
+      g_hash_table_insert (self->csum_to_data_start, &blob->sblob.csum, GUINT_TO_POINTER (data_start));
+    g_cond_broadcast (&self->pending_cond);
+    g_mutex_unlock (&self->lock);
+
+    if (!written) {
+      packed_blob_data_clear (data);
+      return FALSE;
     }
   } else {
     g_mutex_unlock (&self->lock);
   }
 
   blob->sblob.data_start = data_start;
-  blob->sblob.size = blob_size;
 
-  g_assert (close (blob_fd) == 0 || errno == EINTR);
+  packed_blob_data_clear (data);
+  return TRUE;
+}
+
+/**
+ * eos_shard_writer_v2_add_blob:
+ * @self: an #EosShardWriterV2
+ * @name: the name of the blob to store.
+ * @file: a file of contents to write into the shard
+ * @content_type: (allow-none): The MIME type of the blob. Pass %NULL to
+ *   autodetect using Gio.
+ * @flags: flags about how the data should be stored in the file
+ *
+ * Adds the blob at the specified file path to the shard.
+ *
+ * Returns some opaque identifier for the blob, to be passed to
+ * eos_shard_writer_v2_add_blob_to_record().
+ */
+uint64_t
+eos_shard_writer_v2_add_blob (EosShardWriterV2  *self,
+                              char              *name,
+                              GFile             *file,
+                              char              *content_type,
+                              EosShardBlobFlags  flags)
+{
+  struct eos_shard_writer_v2_blob_entry *blob = blob_entry_new (self, name, file, content_type, flags);
+  g_return_val_if_fail (blob != NULL, 0);
+
+  struct packed_blob_data data;
+  prepare_blob_data (blob, file, self->zstd_level, self->zstd_cdict, &data);
+  uint64_t index = append_blob_entry (self, blob);
+  commit_blob_data (self, blob, &data, NULL);
+  return index;
+}
+
+/* Blobs compressed against another shard's zstd dictionary can't be
+ * copied as they are, so decode them and compress them again with our own
+ * settings and dictionary, if any. */
+static gboolean
+repack_blob_data (EosShardWriterV2                      *self,
+                  struct eos_shard_writer_v2_blob_entry *blob,
+                  EosShardBlob                          *source,
+                  struct packed_blob_data               *data,
+                  GError                               **error)
+{
+  g_autoptr(GBytes) contents = eos_shard_blob_load_contents (source, error);
+  if (contents == NULL)
+    return FALSE;
+
+  const ZSTD_CDict *cdict = NULL;
+  if (blob->sblob.flags & EOS_SHARD_V2_BLOB_FLAG_ZSTD_DICTIONARY)
+    cdict = self->zstd_cdict;
+
+  g_autoptr(GChecksum) checksum = g_checksum_new (G_CHECKSUM_SHA256);
+
+  if (blob->sblob.flags & EOS_SHARD_BLOB_FLAG_CHUNKED) {
+    g_autoptr(GInputStream) stream = g_memory_input_stream_new_from_bytes (contents);
+    blob->sblob.size = chunk_blob (stream, blob->sblob.flags, self->zstd_level, cdict,
+                                   blob->sblob.uncompressed_size, checksum, data);
+  } else {
+    gsize size;
+    const void *buf = g_bytes_get_data (contents, &size);
+    data->bytes = codec_encode (blob->sblob.flags, self->zstd_level, cdict, buf, size, error);
+    if (data->bytes == NULL)
+      return FALSE;
+    g_checksum_update (checksum, g_bytes_get_data (data->bytes, NULL), g_bytes_get_size (data->bytes));
+    blob->sblob.size = g_bytes_get_size (data->bytes);
+  }
+
+  size_t checksum_buf_len = sizeof (blob->sblob.csum);
+  g_checksum_get_digest (checksum, blob->sblob.csum, &checksum_buf_len);
+  g_assert (checksum_buf_len == sizeof (blob->sblob.csum));
+
+  return TRUE;
+}
+
+/**
+ * eos_shard_writer_v2_add_packed_blob_from_shard:
+ * @self: an #EosShardWriterV2
+ * @name: the name of the blob to store.
+ * @source: a blob from another shard
+ * @blob_id: (out): return location for the blob's identifier
+ * @error: return location for a #GError
+ *
+ * Adds @source, a blob read from another shard, to the shard. Unlike
+ * eos_shard_writer_v2_add_blob(), the blob's packed contents, flags, sizes
+ * and checksum are carried over as they are, without decompressing or
+ * hashing the contents again, and the contents are copied inside the
+ * kernel where possible. Blobs compressed against a zstd dictionary are
+ * the exception, since the dictionary doesn't carry over; they are
+ * recompressed with this writer's settings.
+ *
+ * The identifier stored at @blob_id is to be passed to
+ * eos_shard_writer_v2_add_blob_to_record().
+ *
+ * Returns: %TRUE if the blob was added
+ */
+gboolean
+eos_shard_writer_v2_add_packed_blob_from_shard (EosShardWriterV2  *self,
+                                                char              *name,
+                                                EosShardBlob      *source,
+                                                uint64_t          *blob_id,
+                                                GError           **error)
+{
+  const char *content_type = source->content_type != NULL ? source->content_type : "";
+
+  g_return_val_if_fail (strlen (name) <= EOS_SHARD_V2_BLOB_MAX_NAME_SIZE, FALSE);
+  g_return_val_if_fail (strlen (content_type) <= EOS_SHARD_V2_BLOB_MAX_CONTENT_TYPE_SIZE, FALSE);
+
+  struct eos_shard_writer_v2_blob_entry *blob = g_new0 (struct eos_shard_writer_v2_blob_entry, 1);
+  blob->name = g_strdup (name);
+  blob->sblob.flags = source->flags;
+  blob->sblob.uncompressed_size = source->uncompressed_size;
+
+  struct packed_blob_data data = { .fd = -1 };
+  if (source->zstd_dictionary) {
+    if (self->zstd_cdict != NULL)
+      blob->sblob.flags |= EOS_SHARD_V2_BLOB_FLAG_ZSTD_DICTIONARY;
+    if (!repack_blob_data (self, blob, source, &data, error)) {
+      eos_shard_writer_v2_blob_entry_free (blob);
+      return FALSE;
+    }
+  } else {
+    blob->sblob.size = source->size;
+    memcpy (blob->sblob.csum, source->checksum, sizeof (blob->sblob.csum));
+    data.source = eos_shard_blob_ref (source);
+  }
+
+  g_mutex_lock (&self->lock);
+  blob->sblob.name_offs = constant_pool_add (&self->cpool, name);
+  blob->sblob.content_type_offs = constant_pool_add (&self->cpool, content_type);
+  g_mutex_unlock (&self->lock);
+
+  /* Only list the blob once its data is in place. */
+  if (!commit_blob_data (self, blob, &data, error)) {
+    eos_shard_writer_v2_blob_entry_free (blob);
+    return FALSE;
+  }
+
+  *blob_id = append_blob_entry (self, blob);
+  return TRUE;
+}
+
+/**
+ * eos_shard_writer_v2_add_shard_set:
+ * @self: an #EosShardWriterV2
+ * @shard_set: the shards to merge
+ * @error: return location for a #GError
+ *
+ * Adds every record that is visible in @shard_set, along with all of its
+ * blobs, to the shard being written. Records which are shadowed by a
+ * higher priority shard or deleted by a tombstone are left out, so after
+ * eos_shard_writer_v2_finish() the new shard answers lookups the same way
+ * @shard_set does.
+ *
+ * Blobs are added with eos_shard_writer_v2_add_packed_blob_from_shard(),
+ * and blobs with the same packed contents are only stored once.
+ *
+ * Returns: %TRUE if all records were added
+ */
+gboolean
+eos_shard_writer_v2_add_shard_set (EosShardWriterV2  *self,
+                                   EosShardShardSet  *shard_set,
+                                   GError           **error)
+{
+  g_autoptr(EosShardShardSetIter) iter = eos_shard_shard_set_iter_new (shard_set);
+  EosShardRecord *record;
+
+  while ((record = eos_shard_shard_set_iter_next (iter)) != NULL) {
+    g_autoptr(EosShardRecord) owned_record = record;
+    g_autoptr(GArray) blob_ids = g_array_new (FALSE, FALSE, sizeof (uint64_t));
+
+    GSList *blobs = eos_shard_record_list_blobs (record);
+    GSList *l;
+    gboolean ret = TRUE;
+
+    /* Copy all of the record's blobs before adding it, so that a failed
+     * copy doesn't leave a partial record behind. */
+    for (l = blobs; l != NULL && ret; l = l->next) {
+      EosShardBlob *blob = l->data;
+      const char *name = blob != NULL ? blob->name : NULL;
+      uint64_t blob_id;
+
+      if (blob == NULL)
+        continue;
+
+      /* V1 shards only have the two well-known blobs, and don't name them. */
+      if (name == NULL)
+        name = (blob == record->metadata) ? EOS_SHARD_V2_BLOB_METADATA : EOS_SHARD_V2_BLOB_DATA;
+
+      ret = eos_shard_writer_v2_add_packed_blob_from_shard (self, (char *) name, blob, &blob_id, error);
+      if (ret)
+        g_array_append_val (blob_ids, blob_id);
+    }
+
+    g_slist_free_full (blobs, (GDestroyNotify) eos_shard_blob_unref);
+    if (!ret)
+      return FALSE;
+
+    g_autofree char *hex_name = eos_shard_record_get_hex_name (record);
+    uint64_t record_id = eos_shard_writer_v2_add_record (self, hex_name);
+    guint i;
+
+    for (i = 0; i < blob_ids->len; i++)
+      eos_shard_writer_v2_add_blob_to_record (self, record_id, g_array_index (blob_ids, uint64_t, i));
+  }
+
+  return TRUE;
+}
+
+struct ingest_job
+{
+  struct eos_shard_writer_v2_blob_entry *blob;
+  GFile *file;
+  int zstd_level;
+  const ZSTD_CDict *zstd_cdict;
+
+  /* Set by the worker once the packed data is ready. */
+  gboolean prepared;
+  struct packed_blob_data data;
+};
+
+static void
+ingest_job_free (struct ingest_job *job)
+{
+  g_object_unref (job->file);
+  g_free (job);
+}
+
+static void
+ingest_prepare_func (gpointer data, gpointer user_data)
+{
+  struct ingest_job *job = data;
+  EosShardWriterV2 *self = user_data;
+
+  prepare_blob_data (job->blob, job->file, job->zstd_level, job->zstd_cdict, &job->data);
+
+  g_mutex_lock (&self->ingest_lock);
+  job->prepared = TRUE;
+
+  /* Whichever worker finds the writer stage idle becomes the writer, and
+   * writes out prepared jobs in the order they were submitted, stopping at
+   * the first one that isn't ready yet. */
+  if (!self->ingest_writing) {
+    self->ingest_writing = TRUE;
+
+    while ((job = g_queue_peek_head (&self->ingest_queue)) != NULL && job->prepared) {
+      g_queue_pop_head (&self->ingest_queue);
+      g_mutex_unlock (&self->ingest_lock);
+
+      commit_blob_data (self, job->blob, &job->data, NULL);
+      ingest_job_free (job);
+
+      g_mutex_lock (&self->ingest_lock);
+      self->ingest_in_flight--;
+      g_cond_broadcast (&self->ingest_cond);
+    }
+
+    self->ingest_writing = FALSE;
+  }
+
+  g_mutex_unlock (&self->ingest_lock);
+}
+
+/**
+ * eos_shard_writer_v2_submit_blob:
+ * @self: an #EosShardWriterV2
+ * @name: the name of the blob to store.
+ * @file: a file of contents to write into the shard
+ * @content_type: (allow-none): The MIME type of the blob. Pass %NULL to
+ *   autodetect using Gio.
+ * @flags: flags about how the data should be stored in the file
+ *
+ * Like eos_shard_writer_v2_add_blob(), but returns without waiting for the
+ * blob to be written. Compression and checksumming happen on a pool of
+ * worker threads, one per processor, and the results are written into the
+ * shard in the order they were submitted. If too many blobs are in flight,
+ * this blocks until some have been written.
+ *
+ * The returned identifier can be passed to
+ * eos_shard_writer_v2_add_blob_to_record() right away. Call
+ * eos_shard_writer_v2_wait_for_blobs() to wait for all submitted blobs to
+ * be written.
+ *
+ * Returns some opaque identifier for the blob.
+ */
+uint64_t
+eos_shard_writer_v2_submit_blob (EosShardWriterV2  *self,
+                                 char              *name,
+                                 GFile             *file,
+                                 char              *content_type,
+                                 EosShardBlobFlags  flags)
+{
+  struct eos_shard_writer_v2_blob_entry *blob = blob_entry_new (self, name, file, content_type, flags);
+  g_return_val_if_fail (blob != NULL, 0);
+
+  struct ingest_job *job = g_new0 (struct ingest_job, 1);
+  job->blob = blob;
+  job->file = g_object_ref (file);
+  job->zstd_level = self->zstd_level;
+  job->zstd_cdict = self->zstd_cdict;
+
+  uint64_t index = append_blob_entry (self, blob);
+
+  g_mutex_lock (&self->ingest_lock);
+
+  if (self->ingest_pool == NULL) {
+    int n_workers = g_get_num_processors ();
+    self->ingest_max_in_flight = n_workers * 2;
+    self->ingest_pool = g_thread_pool_new (ingest_prepare_func, self, n_workers, FALSE, NULL);
+  }
+
+  /* Bound the number of blobs in flight, since each one holds a fd or
+   * its compressed contents in memory. */
+  while (self->ingest_in_flight >= self->ingest_max_in_flight)
+    g_cond_wait (&self->ingest_cond, &self->ingest_lock);
+
+  self->ingest_in_flight++;
+  g_queue_push_tail (&self->ingest_queue, job);
+  g_thread_pool_push (self->ingest_pool, job, NULL);
+
+  g_mutex_unlock (&self->ingest_lock);
 
   return index;
 }
 
+/**
+ * eos_shard_writer_v2_wait_for_blobs:
+ * @self: an #EosShardWriterV2
+ *
+ * Waits until every blob passed to eos_shard_writer_v2_submit_blob() has
+ * been written into the shard.
+ */
+void
+eos_shard_writer_v2_wait_for_blobs (EosShardWriterV2 *self)
+{
+  g_mutex_lock (&self->ingest_lock);
+  while (self->ingest_in_flight > 0)
+    g_cond_wait (&self->ingest_cond, &self->ingest_lock);
+  g_mutex_unlock (&self->ingest_lock);
+}
+
+/**
+ * eos_shard_writer_v2_train_zstd_dictionary:
+ * @self: an #EosShardWriterV2
+ * @samples: (array zero-terminated=1): files whose contents are typical of
+ *   the blobs to be compressed
+ * @max_size: the maximum size of the dictionary in bytes, or 0 for a
+ *   default of 110 KiB
+ * @error: return location for a #GError
+ *
+ * Trains a zstd dictionary on the contents of @samples, and stores it once
+ * in the shard. Blobs added after this with
+ * %EOS_SHARD_BLOB_FLAG_COMPRESSED_ZSTD are compressed against the
+ * dictionary, which greatly improves the ratio for small, similar blobs.
+ * The dictionary uses the #EosShardWriterV2:zstd-level in effect when it
+ * is trained.
+ *
+ * This can only be done once per shard. Training needs a reasonable number
+ * of samples; a few hundred is typical.
+ *
+ * Returns: %TRUE if the dictionary was trained and stored
+ */
+gboolean
+eos_shard_writer_v2_train_zstd_dictionary (EosShardWriterV2  *self,
+                                           GFile            **samples,
+                                           gsize              max_size,
+                                           GError           **error)
+{
+  g_return_val_if_fail (self->zstd_cdict == NULL, FALSE);
+
+  if (max_size == 0)
+    max_size = DEFAULT_ZSTD_DICTIONARY_SIZE;
+
+  g_autoptr(GByteArray) sample_data = g_byte_array_new ();
+  g_autoptr(GArray) sample_sizes = g_array_new (FALSE, FALSE, sizeof (size_t));
+  int i;
+
+  for (i = 0; samples[i] != NULL; i++) {
+    g_autofree char *contents = NULL;
+    gsize length;
+
+    if (!g_file_load_contents (samples[i], NULL, &contents, &length, NULL, error))
+      return FALSE;
+
+    size_t sample_size = length;
+    g_byte_array_append (sample_data, (const guint8 *) contents, length);
+    g_array_append_val (sample_sizes, sample_size);
+  }
+
+  g_autofree uint8_t *dict = g_malloc (max_size);
+  size_t dict_size = ZDICT_trainFromBuffer (dict, max_size, sample_data->data,
+                                            (const size_t *) sample_sizes->data, sample_sizes->len);
+  if (ZDICT_isError (dict_size)) {
+    g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                 "Could not train a zstd dictionary: %s", ZDICT_getErrorName (dict_size));
+    return FALSE;
+  }
+
+  /* Make sure zstd accepts the dictionary before storing it. */
+  ZSTD_CDict *cdict = ZSTD_createCDict (dict, dict_size, self->zstd_level);
+  if (cdict == NULL) {
+    g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                 "Could not load the trained zstd dictionary");
+    return FALSE;
+  }
+
+  /* Place the dictionary in the file like any other blob data. */
+  g_mutex_lock (&self->lock);
+  off_t start = self->ctx.offset;
+  self->ctx.offset = ALIGN (self->ctx.offset + dict_size);
+  g_mutex_unlock (&self->lock);
+
+  g_assert (pwrite (self->ctx.fd, dict, dict_size, start) == dict_size);
+
+  self->zstd_dictionary_start = start;
+  self->zstd_dictionary_size = dict_size;
+  self->zstd_cdict = cdict;
+  return TRUE;
+}
+
 /**
  * eos_shard_writer_v2_add_record:
  * @self: an #EosShardWriterV2
@@ -448,6 +1307,30 @@ eos_shard_writer_v2_add_record (EosShardWriterV2 *self,
   return index;
 }
 
+/**
+ * eos_shard_writer_v2_add_tombstone:
+ * @self: an #EosShardWriterV2
+ * @hex_name: the hex name of the record to delete
+ *
+ * Adds a tombstone record to the shard file. When the shard is layered
+ * over older ones in an #EosShardShardSet, the tombstone hides any record
+ * with the same name in those older shards.
+ */
+void
+eos_shard_writer_v2_add_tombstone (EosShardWriterV2 *self,
+                                   char *hex_name)
+{
+  g_mutex_lock (&self->lock);
+
+  struct eos_shard_writer_v2_record_entry e = {};
+  eos_shard_writer_v2_record_entry_init (&e);
+  eos_shard_util_hex_name_to_raw_name (e.raw_name, hex_name);
+  e.flags = EOS_SHARD_V2_RECORD_FLAG_TOMBSTONE;
+  g_array_append_val (self->records, e);
+
+  g_mutex_unlock (&self->lock);
+}
+
 /**
  * eos_shard_writer_v2_add_blob_to_record:
  * @self: an #EosShardWriterV2
@@ -495,6 +1378,7 @@ write_record (struct write_context *ctx, struct eos_shard_writer_v2_record_entry
 {
   struct eos_shard_v2_record srecord = {};
   memcpy (srecord.raw_name, e->raw_name, EOS_SHARD_RAW_NAME_SIZE);
+  srecord.flags = e->flags;
   srecord.blob_table_start = e->blob_table_start;
   srecord.blob_table_length = e->blobs->len;
   g_assert (pwrite (ctx->fd, &srecord, sizeof (srecord), ctx->offset) >= 0);
@@ -515,6 +1399,9 @@ eos_shard_writer_v2_finish (EosShardWriterV2 *self)
 {
   int i;
 
+  /* Make sure any submitted blobs have made it into the file. */
+  eos_shard_writer_v2_wait_for_blobs (self);
+
   /* Sort our records to allow for binary searches on retrieval. */
   g_array_sort (self->records, &compare_records);
 
@@ -525,6 +1412,12 @@ eos_shard_writer_v2_finish (EosShardWriterV2 *self)
   memcpy (hdr.magic, EOS_SHARD_V2_MAGIC, sizeof (hdr.magic));
   hdr.records_length = self->records->len;
 
+  if (self->zstd_cdict != NULL) {
+    hdr.flags |= EOS_SHARD_V2_HDR_FLAG_ZSTD_DICTIONARY;
+    hdr.zstd_dictionary_start = self->zstd_dictionary_start;
+    hdr.zstd_dictionary_size = self->zstd_dictionary_size;
+  }
+
   /* Now go through and write out blob headers. */
   for (i = 0; i < self->blobs->len; i++) {
     struct eos_shard_writer_v2_blob_entry *b = g_ptr_array_index (self->blobs, i);
@@ -549,6 +1442,23 @@ eos_shard_writer_v2_finish (EosShardWriterV2 *self)
   /* Now for the string constant table... */
   hdr.string_constant_table_start = ALIGN (ctx->offset);
   constant_pool_write (&self->cpool, ctx->fd, hdr.string_constant_table_start);
+  ctx->offset = hdr.string_constant_table_start + self->cpool.total_size;
+
+  /* And the record filter, if asked for. */
+  if (self->record_filter && self->records->len > 0) {
+    struct bloom_filter filter;
+    bloom_filter_init_blocked_for_params (&filter, self->records->len, RECORD_FILTER_FALSE_POSITIVE_RATE);
+    for (i = 0; i < self->records->len; i++) {
+      struct eos_shard_writer_v2_record_entry *e = &g_array_index (self->records, struct eos_shard_writer_v2_record_entry, i);
+      bloom_filter_add_digest (&filter, e->raw_name);
+    }
+
+    hdr.flags |= EOS_SHARD_V2_HDR_FLAG_RECORD_FILTER;
+    hdr.record_filter_start = ctx->offset = ALIGN (ctx->offset);
+    hdr.record_filter_size = bloom_filter_write_to_fd (&filter, ctx->fd, ctx->offset);
+    ctx->offset += hdr.record_filter_size;
+    bloom_filter_dispose (&filter);
+  }
 
   g_assert (pwrite (ctx->fd, &hdr, sizeof (hdr), 0) >= 0);
 }
@@ -21,6 +21,7 @@
 
 #include <gio/gio.h>
 #include "eos-shard-blob.h"
+#include "eos-shard-shard-set.h"
 
 /**
  * EosShardWriter:
@@ -39,8 +40,28 @@ uint64_t eos_shard_writer_v2_add_blob (EosShardWriterV2  *self,
                                        GFile             *file,
                                        char              *content_type,
                                        EosShardBlobFlags  flags);
+uint64_t eos_shard_writer_v2_submit_blob (EosShardWriterV2  *self,
+                                          char              *name,
+                                          GFile             *file,
+                                          char              *content_type,
+                                          EosShardBlobFlags  flags);
+gboolean eos_shard_writer_v2_add_packed_blob_from_shard (EosShardWriterV2  *self,
+                                                         char              *name,
+                                                         EosShardBlob      *source,
+                                                         uint64_t          *blob_id,
+                                                         GError           **error);
+void eos_shard_writer_v2_wait_for_blobs (EosShardWriterV2 *self);
+gboolean eos_shard_writer_v2_train_zstd_dictionary (EosShardWriterV2  *self,
+                                                    GFile            **samples,
+                                                    gsize              max_size,
+                                                    GError           **error);
 uint64_t eos_shard_writer_v2_add_record (EosShardWriterV2 *self,
                                          char *hex_name);
+void eos_shard_writer_v2_add_tombstone (EosShardWriterV2 *self,
+                                        char *hex_name);
+gboolean eos_shard_writer_v2_add_shard_set (EosShardWriterV2  *self,
+                                            EosShardShardSet  *shard_set,
+                                            GError           **error);
 void eos_shard_writer_v2_add_blob_to_record (EosShardWriterV2 *self,
                                              uint64_t          record_id,
                                              uint64_t          blob_id);
@@ -0,0 +1,178 @@
+/* Copyright 2015 Endless Mobile, Inc. */
+
+/* This file is part of eos-shard.
+ *
+ * eos-shard is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * eos-shard is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with eos-shard.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "eos-shard-zstd-converter.h"
+
+#include <zstd.h>
+
+struct _EosShardZstdConverter
+{
+  GObject parent;
+
+  /* Exactly one of these is set, depending on the direction. */
+  ZSTD_CCtx *cctx;
+  ZSTD_DCtx *dctx;
+};
+
+static void converter_iface_init (GConverterIface *iface);
+
+G_DEFINE_TYPE_WITH_CODE (EosShardZstdConverter, eos_shard_zstd_converter, G_TYPE_OBJECT,
+                         G_IMPLEMENT_INTERFACE (G_TYPE_CONVERTER, converter_iface_init));
+
+static GConverterResult
+eos_shard_zstd_converter_convert (GConverter *converter,
+                                  const void *inbuf,
+                                  gsize inbuf_size,
+                                  void *outbuf,
+                                  gsize outbuf_size,
+                                  GConverterFlags flags,
+                                  gsize *bytes_read,
+                                  gsize *bytes_written,
+                                  GError **error)
+{
+  EosShardZstdConverter *self = EOS_SHARD_ZSTD_CONVERTER (converter);
+  ZSTD_inBuffer in = { inbuf, inbuf_size, 0 };
+  ZSTD_outBuffer out = { outbuf, outbuf_size, 0 };
+  ZSTD_EndDirective op = ZSTD_e_continue;
+  size_t ret;
+
+  if (self->cctx != NULL) {
+    if (flags & G_CONVERTER_INPUT_AT_END)
+      op = ZSTD_e_end;
+    else if (flags & G_CONVERTER_FLUSH)
+      op = ZSTD_e_flush;
+
+    ret = ZSTD_compressStream2 (self->cctx, &out, &in, op);
+  } else {
+    ret = ZSTD_decompressStream (self->dctx, &out, &in);
+  }
+
+  if (ZSTD_isError (ret)) {
+    g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                 "zstd error: %s", ZSTD_getErrorName (ret));
+    return G_CONVERTER_ERROR;
+  }
+
+  *bytes_read = in.pos;
+  *bytes_written = out.pos;
+
+  /* For both directions, a return value of 0 means that everything up to
+   * the end of the frame has been written out. */
+  if (self->cctx != NULL) {
+    if (ret == 0 && op == ZSTD_e_end)
+      return G_CONVERTER_FINISHED;
+    if (ret == 0 && op == ZSTD_e_flush)
+      return G_CONVERTER_FLUSHED;
+  } else {
+    if (ret == 0)
+      return G_CONVERTER_FINISHED;
+    if ((flags & G_CONVERTER_FLUSH) && in.pos == in.size && out.pos < out.size)
+      return G_CONVERTER_FLUSHED;
+  }
+
+  if (in.pos == 0 && out.pos == 0) {
+    if (inbuf_size == 0) {
+      g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_PARTIAL_INPUT,
+                           "Need more input");
+    } else {
+      g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_NO_SPACE,
+                           "Not enough space in destination");
+    }
+    return G_CONVERTER_ERROR;
+  }
+
+  return G_CONVERTER_CONVERTED;
+}
+
+static void
+eos_shard_zstd_converter_reset (GConverter *converter)
+{
+  EosShardZstdConverter *self = EOS_SHARD_ZSTD_CONVERTER (converter);
+
+  if (self->cctx != NULL)
+    ZSTD_CCtx_reset (self->cctx, ZSTD_reset_session_only);
+  else
+    ZSTD_DCtx_reset (self->dctx, ZSTD_reset_session_only);
+}
+
+static void
+converter_iface_init (GConverterIface *iface)
+{
+  iface->convert = eos_shard_zstd_converter_convert;
+  iface->reset = eos_shard_zstd_converter_reset;
+}
+
+static void
+eos_shard_zstd_converter_finalize (GObject *object)
+{
+  EosShardZstdConverter *self = EOS_SHARD_ZSTD_CONVERTER (object);
+
+  ZSTD_freeCCtx (self->cctx);
+  ZSTD_freeDCtx (self->dctx);
+
+  G_OBJECT_CLASS (eos_shard_zstd_converter_parent_class)->finalize (object);
+}
+
+static void
+eos_shard_zstd_converter_class_init (EosShardZstdConverterClass *klass)
+{
+  GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
+
+  gobject_class->finalize = eos_shard_zstd_converter_finalize;
+}
+
+static void
+eos_shard_zstd_converter_init (EosShardZstdConverter *self)
+{
+}
+
+/* If @cdict is given, it is used instead of @level. It must outlive the
+ * converter. */
+EosShardZstdConverter *
+_eos_shard_zstd_converter_new_compressor (int level, const ZSTD_CDict *cdict)
+{
+  EosShardZstdConverter *self = g_object_new (EOS_SHARD_TYPE_ZSTD_CONVERTER, NULL);
+
+  self->cctx = ZSTD_createCCtx ();
+  g_assert (self->cctx != NULL);
+
+  if (cdict != NULL)
+    ZSTD_CCtx_refCDict (self->cctx, cdict);
+  else
+    ZSTD_CCtx_setParameter (self->cctx, ZSTD_c_compressionLevel, level);
+
+  return self;
+}
+
+/* @ddict, if given, must outlive the converter. */
+EosShardZstdConverter *
+_eos_shard_zstd_converter_new_decompressor (const ZSTD_DDict *ddict)
+{
+  EosShardZstdConverter *self = g_object_new (EOS_SHARD_TYPE_ZSTD_CONVERTER, NULL);
+
+  self->dctx = ZSTD_createDCtx ();
+  g_assert (self->dctx != NULL);
+
+  if (ddict != NULL)
+    ZSTD_DCtx_refDDict (self->dctx, ddict);
+
+  return self;
+}
@@ -0,0 +1,42 @@
+/* Copyright 2015 Endless Mobile, Inc. */
+
+/* This file is part of eos-shard.
+ *
+ * eos-shard is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * eos-shard is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with eos-shard.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <gio/gio.h>
+
+#include "eos-shard-types.h"
+
+/**
+ * EosShardZstdConverter:
+ *
+ * A #GConverter that compresses or decompresses Zstandard frames, used for
+ * blobs with %EOS_SHARD_BLOB_FLAG_COMPRESSED_ZSTD.
+ */
+
+#define EOS_SHARD_TYPE_ZSTD_CONVERTER (eos_shard_zstd_converter_get_type ())
+G_DECLARE_FINAL_TYPE (EosShardZstdConverter, eos_shard_zstd_converter, EOS_SHARD, ZSTD_CONVERTER, GObject)
+
+#ifndef __GI_SCANNER__
+struct ZSTD_CDict_s;
+struct ZSTD_DDict_s;
+
+EosShardZstdConverter * _eos_shard_zstd_converter_new_compressor (int level, const struct ZSTD_CDict_s *cdict);
+EosShardZstdConverter * _eos_shard_zstd_converter_new_decompressor (const struct ZSTD_DDict_s *ddict);
+#endif
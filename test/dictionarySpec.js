@@ -132,5 +132,37 @@ describe('Dictionary', function () {
                 expect(dictionary.lookup_key(word)).toEqual(null);
             }
         });
+
+        it('can look up many keys at once', function () {
+            let queries = words.filter((word, i) => i % 7 === 0);
+            let fakes = queries.map((word) => word + ' fake');
+            let values = dictionary.lookup_keys(fakes.concat(queries));
+            for (let word of queries)
+                expect(values[word]).toEqual(word.toUpperCase());
+            for (let word of fakes)
+                expect(values[word]).toBeUndefined();
+        });
+
+        function collect(iter) {
+            let keys = [];
+            let [ok, key, value] = iter.next();
+            while (ok) {
+                expect(value).toEqual(key.toUpperCase());
+                keys.push(key);
+                [ok, key, value] = iter.next();
+            }
+            return keys;
+        }
+
+        it('can iterate over a range of keys', function () {
+            let iter = EosShard.DictionaryIter.new(dictionary, 'b', 'c');
+            expect(collect(iter)).toEqual(words.filter((word) => word >= 'b' && word < 'c'));
+        });
+
+        it('can iterate over keys with a prefix', function () {
+            let iter = EosShard.DictionaryIter.new(dictionary, null, null);
+            iter.seek('ab');
+            expect(collect(iter)).toEqual(words.filter((word) => word.startsWith('ab')));
+        });
     });
 });
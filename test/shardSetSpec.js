@@ -0,0 +1,224 @@
+/* Copyright 2015 Endless Mobile, Inc. */
+
+/* This file is part of eos-shard.
+ *
+ * eos-shard is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * eos-shard is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with eos-shard.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+const GLib = imports.gi.GLib;
+const Gio = imports.gi.Gio;
+
+const EosShard = imports.gi.EosShard;
+const TestUtils = imports.utils;
+
+const FIRST = '7d97e98f8af710c7e7fe703abc8f639e0ee507c4';
+const SECOND = 'f572d396fae9206628714fb2ce00f72e94f2258f';
+const THIRD = 'a1b2c3d4e5f60718293a4b5c6d7e8f9012345678';
+
+describe('Shard sets', function () {
+    let shard_paths;
+
+    // Writes a shard holding a record with the given metadata file for each
+    // name in records, and a tombstone for each name in tombstones.
+    function writeShard(records, tombstones) {
+        let [shard_file, iostream] = Gio.File.new_tmp('XXXXXXX.shard');
+        shard_paths.push(shard_file.get_path());
+
+        let shard_writer = new EosShard.WriterV2({ fd: iostream.get_output_stream().get_fd() });
+        Object.keys(records).forEach(function (hex_name) {
+            let r = shard_writer.add_record(hex_name);
+            shard_writer.add_blob_to_record(r, shard_writer.add_blob(EosShard.V2_BLOB_METADATA,
+                                                                     TestUtils.getTestFile(records[hex_name]),
+                                                                     'application/json',
+                                                                     EosShard.BlobFlags.NONE));
+        });
+        tombstones.forEach(function (hex_name) {
+            shard_writer.add_tombstone(hex_name);
+        });
+        shard_writer.finish();
+        iostream.close(null);
+
+        let shard = new EosShard.ShardFile({ path: shard_file.get_path() });
+        shard.init(null);
+        return shard;
+    }
+
+    // Compacts shard_set into a new shard, and opens it.
+    function compact(shard_set) {
+        let [shard_file, iostream] = Gio.File.new_tmp('XXXXXXX.shard');
+        shard_paths.push(shard_file.get_path());
+
+        let shard_writer = new EosShard.WriterV2({ fd: iostream.get_output_stream().get_fd() });
+        shard_writer.add_shard_set(shard_set);
+        shard_writer.finish();
+        iostream.close(null);
+
+        let shard = new EosShard.ShardFile({ path: shard_file.get_path() });
+        shard.init(null);
+        return shard;
+    }
+
+    let shard_set;
+    beforeEach(function () {
+        shard_paths = [];
+
+        let base = {};
+        base[FIRST] = FIRST + '.json';
+        base[SECOND] = FIRST + '.json';
+        let delta = {};
+        delta[SECOND] = SECOND + '.json';
+        delta[THIRD] = SECOND + '.json';
+
+        let base_shard = writeShard(base, []);
+        let delta_shard = writeShard(delta, [FIRST]);
+        shard_set = EosShard.ShardSet.new([delta_shard, base_shard]);
+    });
+
+    afterEach(function () {
+        shard_paths.forEach(function (path) {
+            Gio.File.new_for_path(path).delete(null);
+        });
+    });
+
+    it('finds records from the highest priority shard', function () {
+        let record = shard_set.find_record_by_hex_name(SECOND);
+        expect(record).not.toBe(null);
+        expect(record.metadata.load_contents().get_data().toString()).toMatch(/eggs/);
+        expect(shard_set.find_record_by_hex_name(THIRD)).not.toBe(null);
+    });
+
+    it('hides records deleted by a tombstone', function () {
+        expect(shard_set.find_record_by_hex_name(FIRST)).toBe(null);
+    });
+
+    it('returns null for records not in any shard', function () {
+        expect(shard_set.find_record_by_hex_name('deadbeefdeadbeefdeadbeefdeadbeefdeadbeef')).toBe(null);
+    });
+
+    it('gives the same answers over shards with record filters', function () {
+        let writeFilteredShard = function (records, tombstones) {
+            let [shard_file, iostream] = Gio.File.new_tmp('XXXXXXX.shard');
+            shard_paths.push(shard_file.get_path());
+
+            let shard_writer = new EosShard.WriterV2({ fd: iostream.get_output_stream().get_fd(),
+                                                       record_filter: true });
+            Object.keys(records).forEach(function (hex_name) {
+                let r = shard_writer.add_record(hex_name);
+                shard_writer.add_blob_to_record(r, shard_writer.add_blob(EosShard.V2_BLOB_METADATA,
+                                                                         TestUtils.getTestFile(records[hex_name]),
+                                                                         'application/json',
+                                                                         EosShard.BlobFlags.NONE));
+            });
+            tombstones.forEach(function (hex_name) {
+                shard_writer.add_tombstone(hex_name);
+            });
+            shard_writer.finish();
+            iostream.close(null);
+
+            let shard = new EosShard.ShardFile({ path: shard_file.get_path() });
+            shard.init(null);
+            return shard;
+        };
+
+        let base = {};
+        base[FIRST] = FIRST + '.json';
+        base[SECOND] = FIRST + '.json';
+        let delta = {};
+        delta[SECOND] = SECOND + '.json';
+        delta[THIRD] = SECOND + '.json';
+        let filtered_set = EosShard.ShardSet.new([writeFilteredShard(delta, [FIRST]),
+                                                  writeFilteredShard(base, [])]);
+
+        expect(filtered_set.find_record_by_hex_name(FIRST)).toBe(null);
+        let record = filtered_set.find_record_by_hex_name(SECOND);
+        expect(record.metadata.load_contents().get_data().toString()).toMatch(/eggs/);
+        expect(filtered_set.find_record_by_hex_name(THIRD)).not.toBe(null);
+        expect(filtered_set.find_record_by_hex_name('deadbeefdeadbeefdeadbeefdeadbeefdeadbeef')).toBe(null);
+    });
+
+    it('iterates over the merged records in name order', function () {
+        let iter = EosShard.ShardSetIter.new(shard_set);
+        let names = [];
+        let record;
+        while ((record = iter.next()) !== null) {
+            names.push(record.get_hex_name());
+            if (names[names.length - 1] === SECOND)
+                expect(record.metadata.load_contents().get_data().toString()).toMatch(/eggs/);
+        }
+        expect(names).toEqual([THIRD, SECOND]);
+    });
+
+    it('compacts the set into a single shard', function () {
+        let shard = compact(shard_set);
+
+        expect(shard.find_record_by_hex_name(FIRST)).toBe(null);
+        let record = shard.find_record_by_hex_name(SECOND);
+        expect(record).not.toBe(null);
+        expect(record.metadata.get_name()).toEqual(EosShard.V2_BLOB_METADATA);
+        expect(record.metadata.load_contents().get_data().toString()).toMatch(/eggs/);
+        expect(shard.find_record_by_hex_name(THIRD)).not.toBe(null);
+    });
+
+    it('stores blobs shared between shards once when compacting', function () {
+        let base = {};
+        base[FIRST] = SECOND + '.json';
+        let delta = {};
+        delta[THIRD] = SECOND + '.json';
+        let shard = compact(EosShard.ShardSet.new([writeShard(delta, []), writeShard(base, [])]));
+
+        let first = shard.find_record_by_hex_name(FIRST);
+        let third = shard.find_record_by_hex_name(THIRD);
+        expect(first.metadata.get_offset()).toEqual(third.metadata.get_offset());
+    });
+
+    it('recompresses blobs compressed against a dictionary when compacting', function () {
+        let sample_dir = GLib.dir_make_tmp('shard-samplesXXXXXX');
+        let samples = [];
+        for (let i = 0; i < 300; i++) {
+            let path = GLib.build_filenamev([sample_dir, i + '.json']);
+            GLib.file_set_contents(path, JSON.stringify({
+                title: 'Article number ' + i,
+                synopsis: 'A short article about the number ' + i + ' and its neighbours ' + (i - 1) + ' and ' + (i + 1),
+                tags: ['EknArticleObject', 'number-' + (i % 17)],
+            }));
+            samples.push(Gio.File.new_for_path(path));
+        }
+
+        let [shard_file, iostream] = Gio.File.new_tmp('XXXXXXX.shard');
+        shard_paths.push(shard_file.get_path());
+        let shard_writer = new EosShard.WriterV2({ fd: iostream.get_output_stream().get_fd() });
+        expect(shard_writer.train_zstd_dictionary(samples, 4096)).toBe(true);
+        let r = shard_writer.add_record(FIRST);
+        shard_writer.add_blob_to_record(r, shard_writer.add_blob(EosShard.V2_BLOB_METADATA,
+                                                                 samples[42],
+                                                                 'application/json',
+                                                                 EosShard.BlobFlags.COMPRESSED_ZSTD));
+        shard_writer.finish();
+        iostream.close(null);
+
+        samples.forEach(function (file) {
+            file.delete(null);
+        });
+        Gio.File.new_for_path(sample_dir).delete(null);
+
+        let source = new EosShard.ShardFile({ path: shard_file.get_path() });
+        source.init(null);
+        let shard = compact(EosShard.ShardSet.new([source]));
+
+        let record = shard.find_record_by_hex_name(FIRST);
+        expect(record.metadata.get_flags() & EosShard.BlobFlags.COMPRESSED_ZSTD).toBeTruthy();
+        expect(record.metadata.load_contents().get_data().toString()).toMatch(/Article number 42/);
+    });
+});
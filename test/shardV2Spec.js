@@ -17,6 +17,7 @@
  * <http://www.gnu.org/licenses/>.
  */
 
+const GLib = imports.gi.GLib;
 const Gio = imports.gi.Gio;
 const GObject = imports.gi.GObject;
 
@@ -25,6 +26,25 @@ const TestUtils = imports.utils;
 
 describe('Basic Shard Writing', function () {
     let shard_path, ostream, shard_fd;
+
+    // Overwrites the start of the blob's packed data in the shard file.
+    function corruptBlob(blob) {
+        let iostream = Gio.File.new_for_path(shard_path).open_readwrite(null);
+        iostream.seek(blob.get_offset(), GLib.SeekType.SET, null);
+        iostream.get_output_stream().write_all('XXXX', null);
+        iostream.close(null);
+    }
+
+    function expectChecksumMismatch(func) {
+        let error = null;
+        try {
+            func();
+        } catch (e) {
+            error = e;
+        }
+        expect(error).not.toBe(null);
+        expect(error.matches(EosShard.Error, EosShard.Error.BLOB_CHECKSUM_MISMATCH)).toBe(true);
+    }
     beforeEach(function() {
         let [shard_file, iostream] = Gio.File.new_tmp('XXXXXXX.shard');
         ostream = iostream.get_output_stream();
@@ -105,6 +125,64 @@ describe('Basic Shard Writing', function () {
             let data = record.data.load_contents().get_data().toString();
             expect(data).toMatch(/Lightsaber/);
         });
+
+        it('can load contents into a caller-allocated buffer', function() {
+            let shard_file = new EosShard.ShardFile({ path: shard_path });
+            shard_file.init(null);
+
+            let record = shard_file.find_record_by_hex_name('f572d396fae9206628714fb2ce00f72e94f2258f');
+            [record.metadata, record.data].forEach(function (blob) {
+                let buf = blob.load_contents_into(blob.get_content_size());
+                expect(buf.length).toEqual(blob.get_content_size());
+                expect(buf.toString()).toEqual(blob.load_contents().get_data().toString());
+            });
+        });
+
+        it('can send a range of contents to a file descriptor', function() {
+            let shard_file = new EosShard.ShardFile({ path: shard_path });
+            shard_file.init(null);
+
+            let record = shard_file.find_record_by_hex_name('f572d396fae9206628714fb2ce00f72e94f2258f');
+            [record.metadata, record.data].forEach(function (blob) {
+                let [out_fd, out_path] = GLib.file_open_tmp('XXXXXX.out');
+                let sent = blob.send_to_fd(out_fd, 10, 100, null);
+                GLib.close(out_fd);
+
+                let out_file = Gio.File.new_for_path(out_path);
+                let [success, sent_data] = out_file.load_contents(null);
+                out_file.delete(null);
+
+                let expected = blob.load_contents().get_data().slice(10, 110);
+                expect(sent).toEqual(100);
+                expect(sent_data.toString()).toEqual(expected.toString());
+            });
+        });
+
+        it('can read blob streams asynchronously', function() {
+            let shard_file = new EosShard.ShardFile({ path: shard_path });
+            shard_file.init(null);
+
+            let record = shard_file.find_record_by_hex_name('f572d396fae9206628714fb2ce00f72e94f2258f');
+            let stream = record.metadata.get_stream();
+            let loop = GLib.MainLoop.new(null, false);
+            let chunks = [];
+
+            let read_next = function () {
+                stream.read_bytes_async(1000, GLib.PRIORITY_DEFAULT, null, function (stream, result) {
+                    let bytes = stream.read_bytes_finish(result);
+                    if (bytes.get_size() === 0) {
+                        loop.quit();
+                        return;
+                    }
+                    chunks.push(bytes.get_data().toString());
+                    read_next();
+                });
+            };
+            read_next();
+            loop.run();
+
+            expect(chunks.join('')).toEqual(record.metadata.load_contents().get_data().toString());
+        });
     });
 
     describe('multiple record shards', function() {
@@ -160,6 +238,139 @@ describe('Basic Shard Writing', function () {
             expect(record_names).toEqual(['7d97e98f8af710c7e7fe703abc8f639e0ee507c4',
                                           'f572d396fae9206628714fb2ce00f72e94f2258f']);
         });
+
+        it('can find several records at once', function() {
+            let shard_file = new EosShard.ShardFile({ path: shard_path });
+            shard_file.init(null);
+
+            let records = shard_file.find_records_by_hex_names(['f572d396fae9206628714fb2ce00f72e94f2258f',
+                                                                'deadbeefdeadbeefdeadbeefdeadbeefdeadbeef',
+                                                                '7d97e98f8af710c7e7fe703abc8f639e0ee507c4']);
+            expect(records.length).toEqual(3);
+            expect(records[0].get_hex_name()).toEqual('f572d396fae9206628714fb2ce00f72e94f2258f');
+            expect(records[1]).toBe(null);
+            expect(records[2].get_hex_name()).toEqual('7d97e98f8af710c7e7fe703abc8f639e0ee507c4');
+        });
+
+        it('can look up records and load blobs asynchronously', function() {
+            let shard_file = new EosShard.ShardFile({ path: shard_path });
+            shard_file.init(null);
+
+            let loop = GLib.MainLoop.new(null, false);
+            let data;
+            shard_file.find_record_by_hex_name_async('f572d396fae9206628714fb2ce00f72e94f2258f', null, function (shard_file, result) {
+                let record = shard_file.find_record_by_hex_name_finish(result);
+                record.lookup_blob_async(EosShard.V2_BLOB_DATA, null, function (source, result) {
+                    let blob = record.lookup_blob_finish(result);
+                    blob.load_contents_async(null, function (source, result) {
+                        data = blob.load_contents_finish(result);
+                        loop.quit();
+                    });
+                });
+            });
+            loop.run();
+
+            expect(data.get_data().toString()).toMatch(/Lightsaber/);
+        });
+
+        it('can verify every blob up front', function() {
+            let shard_file = new EosShard.ShardFile({ path: shard_path });
+            shard_file.init(null);
+
+            expect(shard_file.verify_all(null)).toBe(true);
+        });
+
+        it('fails the stream read that reaches the end of a corrupted blob', function() {
+            let shard_file = new EosShard.ShardFile({ path: shard_path });
+            shard_file.init(null);
+            corruptBlob(shard_file.find_record_by_hex_name('f572d396fae9206628714fb2ce00f72e94f2258f').metadata);
+
+            shard_file = new EosShard.ShardFile({ path: shard_path });
+            shard_file.init(null);
+            let record = shard_file.find_record_by_hex_name('f572d396fae9206628714fb2ce00f72e94f2258f');
+            let size = record.metadata.get_packed_content_size();
+            let stream = record.metadata.get_stream();
+
+            let pos = 0;
+            while (pos + 8 < size)
+                pos += stream.read_bytes(8, null).get_size();
+            expectChecksumMismatch(function () {
+                stream.read_bytes(8, null);
+            });
+        });
+
+        it('verifies again after rewinding past a non-sequential read', function() {
+            let shard_file = new EosShard.ShardFile({ path: shard_path });
+            shard_file.init(null);
+            corruptBlob(shard_file.find_record_by_hex_name('f572d396fae9206628714fb2ce00f72e94f2258f').metadata);
+
+            shard_file = new EosShard.ShardFile({ path: shard_path });
+            shard_file.init(null);
+            let record = shard_file.find_record_by_hex_name('f572d396fae9206628714fb2ce00f72e94f2258f');
+            let size = record.metadata.get_packed_content_size();
+            let stream = record.metadata.get_stream();
+
+            stream.seek(4, GLib.SeekType.SET, null);
+            stream.read_bytes(size, null);
+
+            stream.seek(0, GLib.SeekType.SET, null);
+            expectChecksumMismatch(function () {
+                stream.read_bytes(size, null);
+            });
+        });
+
+        it('can read contents with each checksum policy', function() {
+            [EosShard.ChecksumPolicy.ALWAYS,
+             EosShard.ChecksumPolicy.ONCE,
+             EosShard.ChecksumPolicy.SAMPLED,
+             EosShard.ChecksumPolicy.NEVER].forEach(function(policy) {
+                let shard_file = new EosShard.ShardFile({ path: shard_path, checksum_policy: policy });
+                shard_file.init(null);
+
+                let record = shard_file.find_record_by_hex_name('f572d396fae9206628714fb2ce00f72e94f2258f');
+                for (let i = 0; i < 2; i++) {
+                    let metadata = record.metadata.load_contents().get_data().toString();
+                    expect(metadata).toMatch(/eggs/);
+                }
+            });
+        });
+
+        it('verifies a corrupted blob on every load with the always policy', function() {
+            let shard_file = new EosShard.ShardFile({ path: shard_path, checksum_policy: EosShard.ChecksumPolicy.ALWAYS });
+            shard_file.init(null);
+            let record = shard_file.find_record_by_hex_name('f572d396fae9206628714fb2ce00f72e94f2258f');
+            record.metadata.load_contents();
+
+            corruptBlob(record.metadata);
+            expectChecksumMismatch(function () {
+                record.metadata.load_contents();
+            });
+        });
+
+        it('only verifies a blob once with the once policy', function() {
+            let shard_file = new EosShard.ShardFile({ path: shard_path, checksum_policy: EosShard.ChecksumPolicy.ONCE });
+            shard_file.init(null);
+            let record = shard_file.find_record_by_hex_name('f572d396fae9206628714fb2ce00f72e94f2258f');
+            record.metadata.load_contents();
+
+            corruptBlob(record.metadata);
+            expect(function () {
+                record.metadata.load_contents();
+            }).not.toThrow();
+        });
+
+        it('never verifies blobs with the never policy', function() {
+            let shard_file = new EosShard.ShardFile({ path: shard_path });
+            shard_file.init(null);
+            corruptBlob(shard_file.find_record_by_hex_name('f572d396fae9206628714fb2ce00f72e94f2258f').metadata);
+
+            shard_file = new EosShard.ShardFile({ path: shard_path, checksum_policy: EosShard.ChecksumPolicy.NEVER });
+            shard_file.init(null);
+            let record = shard_file.find_record_by_hex_name('f572d396fae9206628714fb2ce00f72e94f2258f');
+            expect(function () {
+                record.metadata.load_contents();
+            }).not.toThrow();
+        });
     });
 
     describe('NULL errors', function() {
@@ -217,6 +428,476 @@ describe('Basic Shard Writing', function () {
         });
     });
 
+    describe('zstd compression', function() {
+        beforeEach(function() {
+            let shard_writer = new EosShard.WriterV2({ fd: shard_fd, zstd_level: 9 });
+
+            let r = shard_writer.add_record('f572d396fae9206628714fb2ce00f72e94f2258f');
+            shard_writer.add_blob_to_record(r, shard_writer.add_blob(EosShard.V2_BLOB_METADATA,
+                                                                     TestUtils.getTestFile('f572d396fae9206628714fb2ce00f72e94f2258f.json'),
+                                                                     'application/json',
+                                                                     EosShard.BlobFlags.COMPRESSED_ZSTD));
+            shard_writer.add_blob_to_record(r, shard_writer.add_blob(EosShard.V2_BLOB_DATA,
+                                                                     TestUtils.getTestFile('f572d396fae9206628714fb2ce00f72e94f2258f.blob'),
+                                                                     null,
+                                                                     EosShard.BlobFlags.COMPRESSED_ZSTD));
+
+            shard_writer.finish();
+        });
+
+        it('can read zstd compressed contents', function() {
+            let shard_file = new EosShard.ShardFile({ path: shard_path });
+            shard_file.init(null);
+
+            let record = shard_file.find_record_by_hex_name('f572d396fae9206628714fb2ce00f72e94f2258f');
+            expect(record.data.get_flags() & EosShard.BlobFlags.COMPRESSED_ZSTD).toBeTruthy();
+            expect(record.data.get_packed_content_size()).toBeLessThan(record.data.get_content_size());
+
+            let metadata = record.metadata.load_contents().get_data().toString();
+            expect(metadata).toMatch(/eggs/);
+            let data = record.data.load_contents().get_data().toString();
+            expect(data).toMatch(/Lightsaber/);
+        });
+
+        it('can stream zstd compressed contents', function() {
+            let shard_file = new EosShard.ShardFile({ path: shard_path });
+            shard_file.init(null);
+
+            let record = shard_file.find_record_by_hex_name('f572d396fae9206628714fb2ce00f72e94f2258f');
+            let stream = record.data.get_stream();
+            let out_stream = Gio.MemoryOutputStream.new_resizable();
+            out_stream.splice(stream, Gio.OutputStreamSpliceFlags.CLOSE_SOURCE | Gio.OutputStreamSpliceFlags.CLOSE_TARGET, null);
+            let streamed = out_stream.steal_as_bytes();
+            expect(streamed.get_data().toString()).toEqual(record.data.load_contents().get_data().toString());
+        });
+    });
+
+    describe('lz4 compression', function() {
+        beforeEach(function() {
+            let shard_writer = new EosShard.WriterV2({ fd: shard_fd });
+
+            let r = shard_writer.add_record('f572d396fae9206628714fb2ce00f72e94f2258f');
+            shard_writer.add_blob_to_record(r, shard_writer.add_blob(EosShard.V2_BLOB_METADATA,
+                                                                     TestUtils.getTestFile('f572d396fae9206628714fb2ce00f72e94f2258f.json'),
+                                                                     'application/json',
+                                                                     EosShard.BlobFlags.COMPRESSED_LZ4));
+            shard_writer.add_blob_to_record(r, shard_writer.add_blob(EosShard.V2_BLOB_DATA,
+                                                                     TestUtils.getTestFile('f572d396fae9206628714fb2ce00f72e94f2258f.blob'),
+                                                                     null,
+                                                                     EosShard.BlobFlags.COMPRESSED_ZSTD));
+
+            shard_writer.finish();
+        });
+
+        it('can read lz4 compressed metadata', function() {
+            let shard_file = new EosShard.ShardFile({ path: shard_path });
+            shard_file.init(null);
+
+            let record = shard_file.find_record_by_hex_name('f572d396fae9206628714fb2ce00f72e94f2258f');
+            expect(record.metadata.get_flags() & EosShard.BlobFlags.COMPRESSED_LZ4).toBeTruthy();
+
+            let metadata = record.metadata.load_contents().get_data().toString();
+            expect(metadata).toMatch(/eggs/);
+            let data = record.data.load_contents().get_data().toString();
+            expect(data).toMatch(/Lightsaber/);
+        });
+
+        it('can stream lz4 compressed metadata', function() {
+            let shard_file = new EosShard.ShardFile({ path: shard_path });
+            shard_file.init(null);
+
+            let record = shard_file.find_record_by_hex_name('f572d396fae9206628714fb2ce00f72e94f2258f');
+            let stream = record.metadata.get_stream();
+            let out_stream = Gio.MemoryOutputStream.new_resizable();
+            out_stream.splice(stream, Gio.OutputStreamSpliceFlags.CLOSE_SOURCE | Gio.OutputStreamSpliceFlags.CLOSE_TARGET, null);
+            let streamed = out_stream.steal_as_bytes();
+            expect(streamed.get_data().toString()).toEqual(record.metadata.load_contents().get_data().toString());
+        });
+    });
+
+    describe('zstd dictionaries', function() {
+        let sample_dir, samples;
+        beforeEach(function() {
+            sample_dir = GLib.dir_make_tmp('shard-samplesXXXXXX');
+            samples = [];
+            for (let i = 0; i < 300; i++) {
+                let path = GLib.build_filenamev([sample_dir, i + '.json']);
+                GLib.file_set_contents(path, JSON.stringify({
+                    title: 'Article number ' + i,
+                    synopsis: 'A short article about the number ' + i + ' and its neighbours ' + (i - 1) + ' and ' + (i + 1),
+                    contentType: 'text/html',
+                    tags: ['EknArticleObject', 'number-' + (i % 17)],
+                }));
+                samples.push(Gio.File.new_for_path(path));
+            }
+        });
+
+        afterEach(function() {
+            samples.forEach(function (file) {
+                file.delete(null);
+            });
+            Gio.File.new_for_path(sample_dir).delete(null);
+        });
+
+        it('can compress blobs against a trained dictionary', function() {
+            let shard_writer = new EosShard.WriterV2({ fd: shard_fd });
+            expect(shard_writer.train_zstd_dictionary(samples, 4096)).toBe(true);
+
+            let r = shard_writer.add_record('f572d396fae9206628714fb2ce00f72e94f2258f');
+            shard_writer.add_blob_to_record(r, shard_writer.add_blob(EosShard.V2_BLOB_METADATA,
+                                                                     samples[42],
+                                                                     'application/json',
+                                                                     EosShard.BlobFlags.COMPRESSED_ZSTD));
+            shard_writer.add_blob_to_record(r, shard_writer.add_blob(EosShard.V2_BLOB_DATA,
+                                                                     TestUtils.getTestFile('f572d396fae9206628714fb2ce00f72e94f2258f.blob'),
+                                                                     null,
+                                                                     EosShard.BlobFlags.COMPRESSED_ZSTD));
+            shard_writer.finish();
+
+            let shard_file = new EosShard.ShardFile({ path: shard_path });
+            shard_file.init(null);
+
+            let record = shard_file.find_record_by_hex_name('f572d396fae9206628714fb2ce00f72e94f2258f');
+            let metadata = record.metadata.load_contents().get_data().toString();
+            expect(metadata).toMatch(/Article number 42/);
+            let data = record.data.load_contents().get_data().toString();
+            expect(data).toMatch(/Lightsaber/);
+
+            let stream = record.metadata.get_stream();
+            let out_stream = Gio.MemoryOutputStream.new_resizable();
+            out_stream.splice(stream, Gio.OutputStreamSpliceFlags.CLOSE_SOURCE | Gio.OutputStreamSpliceFlags.CLOSE_TARGET, null);
+            expect(out_stream.steal_as_bytes().get_data().toString()).toEqual(metadata);
+        });
+    });
+
+    describe('large blob streams', function() {
+        // Larger than the biggest read-ahead window.
+        let large_file;
+        beforeEach(function() {
+            large_file = TestUtils.makeLargeTestFile(1536 * 1024);
+
+            let shard_writer = new EosShard.WriterV2({ fd: shard_fd });
+            let r = shard_writer.add_record('f572d396fae9206628714fb2ce00f72e94f2258f');
+            shard_writer.add_blob_to_record(r, shard_writer.add_blob(EosShard.V2_BLOB_DATA,
+                                                                     large_file,
+                                                                     null,
+                                                                     EosShard.BlobFlags.NONE));
+            shard_writer.finish();
+        });
+
+        afterEach(function() {
+            large_file.delete(null);
+        });
+
+        it('reads the same data through the read-ahead buffer', function() {
+            let shard_file = new EosShard.ShardFile({ path: shard_path });
+            shard_file.init(null);
+
+            let record = shard_file.find_record_by_hex_name('f572d396fae9206628714fb2ce00f72e94f2258f');
+            let contents = record.data.load_contents().get_data().toString();
+            let stream = record.data.get_stream();
+
+            // Small sequential reads grow the window up to its maximum.
+            let chunks = [];
+            let bytes;
+            while ((bytes = stream.read_bytes(4096, null)).get_size() > 0)
+                chunks.push(bytes.get_data().toString());
+            expect(chunks.join('')).toEqual(contents);
+
+            // Seeking back starts over with a small window, which a large
+            // read bypasses...
+            stream.seek(100000, GLib.SeekType.SET, null);
+            bytes = stream.read_bytes(65536, null);
+            expect(bytes.get_data().toString()).toEqual(contents.slice(100000, 100000 + 65536));
+
+            // ... and small reads after another seek come from a refilled
+            // buffer, not the stale one.
+            stream.seek(500, GLib.SeekType.SET, null);
+            for (let offset = 500; offset < 500 + 3 * 4096; offset += 4096) {
+                bytes = stream.read_bytes(4096, null);
+                expect(bytes.get_data().toString()).toEqual(contents.slice(offset, offset + 4096));
+            }
+        });
+    });
+
+    describe('chunked blobs', function() {
+        // Spans several 64 KiB chunks, with the last one partially filled.
+        let large_file;
+        beforeEach(function() {
+            large_file = TestUtils.makeLargeTestFile(300000);
+
+            let shard_writer = new EosShard.WriterV2({ fd: shard_fd });
+
+            let r = shard_writer.add_record('f572d396fae9206628714fb2ce00f72e94f2258f');
+            shard_writer.add_blob_to_record(r, shard_writer.add_blob(EosShard.V2_BLOB_DATA,
+                                                                     large_file,
+                                                                     null,
+                                                                     EosShard.BlobFlags.COMPRESSED_ZSTD | EosShard.BlobFlags.CHUNKED));
+
+            shard_writer.finish();
+        });
+
+        afterEach(function() {
+            large_file.delete(null);
+        });
+
+        it('can read chunked contents', function() {
+            let shard_file = new EosShard.ShardFile({ path: shard_path });
+            shard_file.init(null);
+
+            let record = shard_file.find_record_by_hex_name('f572d396fae9206628714fb2ce00f72e94f2258f');
+            expect(record.data.get_flags() & EosShard.BlobFlags.CHUNKED).toBeTruthy();
+
+            let expected = large_file.load_contents(null)[1];
+            let data = record.data.load_contents().get_data();
+            expect(data.length).toEqual(expected.length);
+            expect(data.toString()).toEqual(expected.toString());
+        });
+
+        it('can stream chunked contents across chunk boundaries', function() {
+            let shard_file = new EosShard.ShardFile({ path: shard_path });
+            shard_file.init(null);
+
+            let record = shard_file.find_record_by_hex_name('f572d396fae9206628714fb2ce00f72e94f2258f');
+            let stream = record.data.get_stream();
+            let out_stream = Gio.MemoryOutputStream.new_resizable();
+            out_stream.splice(stream, Gio.OutputStreamSpliceFlags.CLOSE_SOURCE | Gio.OutputStreamSpliceFlags.CLOSE_TARGET, null);
+            let streamed = out_stream.steal_as_bytes();
+            expect(streamed.get_data().toString()).toEqual(large_file.load_contents(null)[1].toString());
+        });
+
+        it('can seek in uncompressed coordinates', function() {
+            let shard_file = new EosShard.ShardFile({ path: shard_path });
+            shard_file.init(null);
+
+            let record = shard_file.find_record_by_hex_name('f572d396fae9206628714fb2ce00f72e94f2258f');
+            let contents = record.data.load_contents().get_data();
+
+            let stream = record.data.get_stream();
+            expect(GObject.type_is_a(stream, Gio.Seekable)).toBe(true);
+
+            // Land in the middle of the fourth chunk, then read across the
+            // boundary into the fifth, then go back to the first.
+            [3 * 65536 + 12345, 4 * 65536 - 50, 12345].forEach(function (offset) {
+                stream.seek(offset, GLib.SeekType.SET, null);
+                // Reads stop at the end of a chunk, so keep going.
+                let read = '';
+                while (read.length < 100)
+                    read += stream.read_bytes(100 - read.length, null).get_data().toString();
+                expect(read).toEqual(contents.slice(offset, offset + 100).toString());
+            });
+        });
+    });
+
+    describe('record filters', function() {
+        it('finds records and rejects missing ones', function() {
+            let shard_writer = new EosShard.WriterV2({ fd: shard_fd, record_filter: true });
+            let names = [];
+            for (let i = 0; i < 64; i++) {
+                let name = GLib.compute_checksum_for_string(GLib.ChecksumType.SHA1, 'record ' + i, -1);
+                names.push(name);
+                let r = shard_writer.add_record(name);
+                shard_writer.add_blob_to_record(r, shard_writer.add_blob(EosShard.V2_BLOB_METADATA,
+                                                                         TestUtils.getTestFile('f572d396fae9206628714fb2ce00f72e94f2258f.json'),
+                                                                         'application/json',
+                                                                         EosShard.BlobFlags.NONE));
+            }
+            shard_writer.finish();
+
+            let shard_file = new EosShard.ShardFile({ path: shard_path });
+            shard_file.init(null);
+
+            names.forEach(function (name) {
+                expect(shard_file.find_record_by_hex_name(name)).not.toBe(null);
+            });
+            for (let i = 0; i < 64; i++) {
+                let name = GLib.compute_checksum_for_string(GLib.ChecksumType.SHA1, 'missing ' + i, -1);
+                expect(shard_file.find_record_by_hex_name(name)).toBe(null);
+            }
+        });
+    });
+
+    describe('batched lookups', function() {
+        it('finds more records than fit in one batch of reads', function() {
+            let shard_writer = new EosShard.WriterV2({ fd: shard_fd });
+            let names = [];
+            for (let i = 0; i < 100; i++) {
+                let name = GLib.compute_checksum_for_string(GLib.ChecksumType.SHA1, 'record ' + i, -1);
+                names.push(name);
+                if (i % 10 === 0) {
+                    shard_writer.add_tombstone(name);
+                    continue;
+                }
+                let r = shard_writer.add_record(name);
+                shard_writer.add_blob_to_record(r, shard_writer.add_blob(EosShard.V2_BLOB_METADATA,
+                                                                         TestUtils.getTestFile('f572d396fae9206628714fb2ce00f72e94f2258f.json'),
+                                                                         'application/json',
+                                                                         EosShard.BlobFlags.NONE));
+            }
+            shard_writer.finish();
+
+            let missing = [];
+            for (let i = 0; i < 50; i++)
+                missing.push(GLib.compute_checksum_for_string(GLib.ChecksumType.SHA1, 'missing ' + i, -1));
+
+            let shard_file = new EosShard.ShardFile({ path: shard_path });
+            shard_file.init(null);
+
+            let records = shard_file.find_records_by_hex_names(names.concat(missing));
+            expect(records.length).toEqual(150);
+            names.forEach(function (name, i) {
+                if (i % 10 === 0) {
+                    expect(records[i]).toBe(null);
+                } else {
+                    expect(records[i].get_hex_name()).toEqual(name);
+                    expect(records[i].metadata.load_contents().get_data().toString()).toMatch(/eggs/);
+                }
+            });
+            for (let i = 100; i < 150; i++)
+                expect(records[i]).toBe(null);
+        });
+    });
+
+    describe('parallel ingestion', function() {
+        it('can submit blobs and write them in order', function() {
+            let shard_writer = new EosShard.WriterV2({ fd: shard_fd });
+            let names = [];
+            for (let i = 0; i < 16; i++) {
+                let name = GLib.compute_checksum_for_string(GLib.ChecksumType.SHA1, 'record ' + i, -1);
+                names.push(name);
+                let r = shard_writer.add_record(name);
+                shard_writer.add_blob_to_record(r, shard_writer.submit_blob(EosShard.V2_BLOB_METADATA,
+                                                                            TestUtils.getTestFile('f572d396fae9206628714fb2ce00f72e94f2258f.json'),
+                                                                            'application/json',
+                                                                            EosShard.BlobFlags.NONE));
+                shard_writer.add_blob_to_record(r, shard_writer.submit_blob(EosShard.V2_BLOB_DATA,
+                                                                            TestUtils.getTestFile('f572d396fae9206628714fb2ce00f72e94f2258f.blob'),
+                                                                            null,
+                                                                            EosShard.BlobFlags.COMPRESSED_ZLIB));
+            }
+            shard_writer.finish();
+
+            let shard_file = new EosShard.ShardFile({ path: shard_path });
+            shard_file.init(null);
+
+            names.forEach(function (name) {
+                let record = shard_file.find_record_by_hex_name(name);
+                expect(record).not.toBe(null);
+                let metadata = record.metadata.load_contents().get_data().toString();
+                expect(metadata).toMatch(/eggs/);
+                let data = record.data.load_contents().get_data().toString();
+                expect(data).toMatch(/Lightsaber/);
+            });
+        });
+    });
+
+    describe('packed blob copies', function() {
+        let source_path;
+
+        function readPacked(path, blob) {
+            let stream = Gio.File.new_for_path(path).read(null);
+            stream.seek(blob.get_offset(), GLib.SeekType.SET, null);
+            let bytes = stream.read_bytes(blob.get_packed_content_size(), null);
+            stream.close(null);
+
+            // Packed data isn't text, so compare it byte by byte.
+            let data = bytes.get_data();
+            let values = [];
+            for (let i = 0; i < data.length; i++)
+                values.push(data[i]);
+            return values;
+        }
+        beforeEach(function() {
+            let [source_file, source_iostream] = Gio.File.new_tmp('XXXXXXX.shard');
+            source_path = source_file.get_path();
+
+            let shard_writer = new EosShard.WriterV2({ fd: source_iostream.get_output_stream().get_fd() });
+            let r = shard_writer.add_record('f572d396fae9206628714fb2ce00f72e94f2258f');
+            shard_writer.add_blob_to_record(r, shard_writer.add_blob(EosShard.V2_BLOB_METADATA,
+                                                                     TestUtils.getTestFile('f572d396fae9206628714fb2ce00f72e94f2258f.json'),
+                                                                     'application/json',
+                                                                     EosShard.BlobFlags.NONE));
+            shard_writer.add_blob_to_record(r, shard_writer.add_blob(EosShard.V2_BLOB_DATA,
+                                                                     TestUtils.getTestFile('f572d396fae9206628714fb2ce00f72e94f2258f.blob'),
+                                                                     null,
+                                                                     EosShard.BlobFlags.COMPRESSED_ZSTD));
+            shard_writer.finish();
+            source_iostream.close(null);
+        });
+
+        afterEach(function() {
+            Gio.File.new_for_path(source_path).delete(null);
+        });
+
+        it('can copy packed blobs from another shard', function() {
+            let source = new EosShard.ShardFile({ path: source_path });
+            source.init(null);
+            let source_record = source.find_record_by_hex_name('f572d396fae9206628714fb2ce00f72e94f2258f');
+
+            let shard_writer = new EosShard.WriterV2({ fd: shard_fd });
+            let r = shard_writer.add_record('f572d396fae9206628714fb2ce00f72e94f2258f');
+            shard_writer.add_blob_to_record(r, shard_writer.add_packed_blob_from_shard(EosShard.V2_BLOB_METADATA,
+                                                                                       source_record.metadata));
+            shard_writer.add_blob_to_record(r, shard_writer.add_packed_blob_from_shard(EosShard.V2_BLOB_DATA,
+                                                                                       source_record.data));
+            shard_writer.finish();
+
+            let shard_file = new EosShard.ShardFile({ path: shard_path });
+            shard_file.init(null);
+
+            let record = shard_file.find_record_by_hex_name('f572d396fae9206628714fb2ce00f72e94f2258f');
+            expect(record.metadata.get_content_type()).toEqual('application/json');
+            expect(record.data.get_flags()).toEqual(source_record.data.get_flags());
+            expect(record.data.get_packed_content_size()).toEqual(source_record.data.get_packed_content_size());
+
+            // The packed bytes, and so the checksum, are carried over
+            // untouched rather than recompressed.
+            expect(readPacked(shard_path, record.data)).toEqual(readPacked(source_path, source_record.data));
+            expect(readPacked(shard_path, record.metadata)).toEqual(readPacked(source_path, source_record.metadata));
+
+            let metadata = record.metadata.load_contents().get_data().toString();
+            expect(metadata).toMatch(/eggs/);
+            let data = record.data.load_contents().get_data().toString();
+            expect(data).toMatch(/Lightsaber/);
+        });
+
+        it('stores a blob copied twice only once', function() {
+            let source = new EosShard.ShardFile({ path: source_path });
+            source.init(null);
+            let source_record = source.find_record_by_hex_name('f572d396fae9206628714fb2ce00f72e94f2258f');
+
+            let shard_writer = new EosShard.WriterV2({ fd: shard_fd });
+            ['f572d396fae9206628714fb2ce00f72e94f2258f', '7d97e98f8af710c7e7fe703abc8f639e0ee507c4'].forEach(function (name) {
+                let r = shard_writer.add_record(name);
+                shard_writer.add_blob_to_record(r, shard_writer.add_packed_blob_from_shard(EosShard.V2_BLOB_DATA,
+                                                                                           source_record.data));
+            });
+            shard_writer.finish();
+
+            let shard_file = new EosShard.ShardFile({ path: shard_path });
+            shard_file.init(null);
+
+            let first = shard_file.find_record_by_hex_name('f572d396fae9206628714fb2ce00f72e94f2258f');
+            let second = shard_file.find_record_by_hex_name('7d97e98f8af710c7e7fe703abc8f639e0ee507c4');
+            expect(first.data.get_offset()).toEqual(second.data.get_offset());
+        });
+
+        it('reports an error when the source shard is truncated', function() {
+            let source = new EosShard.ShardFile({ path: source_path });
+            source.init(null);
+            let source_record = source.find_record_by_hex_name('f572d396fae9206628714fb2ce00f72e94f2258f');
+
+            let iostream = Gio.File.new_for_path(source_path).open_readwrite(null);
+            iostream.truncate(source_record.data.get_offset() + 1, null);
+            iostream.close(null);
+
+            let shard_writer = new EosShard.WriterV2({ fd: shard_fd });
+            expect(function () {
+                shard_writer.add_packed_blob_from_shard(EosShard.V2_BLOB_DATA, source_record.data);
+            }).toThrow();
+        });
+    });
+
     describe('Alignment Conditions', function() {
         // This is to test a very specific error. Since we align shard contents
         // to 64 byte 'chunks', we want to make sure that there are no errors in
@@ -345,6 +1026,16 @@ describe('Basic Shard Writing', function () {
             let dataStream = record.data.get_stream();
             expect(GObject.type_is_a(dataStream, Gio.Seekable)).toBe(false);
         });
+
+        it('streams the same contents as load_contents', function () {
+            let shard_file = new EosShard.ShardFile({ path: shard_path });
+            shard_file.init(null);
+
+            let record = shard_file.find_record_by_hex_name('f572d396fae9206628714fb2ce00f72e94f2258f');
+            let dataStream = record.data.get_stream();
+            let streamed = dataStream.read_bytes(record.data.get_content_size(), null);
+            expect(streamed.get_data().toString()).toEqual(record.data.load_contents().get_data().toString());
+        });
     });
 
     describe('handles deduplication', function () {
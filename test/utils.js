@@ -26,3 +26,21 @@ function getTestFile(fn) {
         datadir = '';
     return Gio.File.new_for_path(GLib.build_filenamev([datadir, 'test/data', fn]));
 }
+
+// Creates a temporary file of numbered text lines at least @size bytes
+// long, so that every position in it has distinct contents. The caller is
+// responsible for deleting it.
+function makeLargeTestFile(size) {
+    let [file, iostream] = Gio.File.new_tmp('XXXXXXX.data');
+    iostream.close(null);
+
+    let lines = [];
+    let length = 0;
+    for (let i = 0; length < size; i++) {
+        let line = 'line ' + i + '\n';
+        lines.push(line);
+        length += line.length;
+    }
+    GLib.file_set_contents(file.get_path(), lines.join(''));
+    return file;
+}
@@ -0,0 +1,150 @@
+/* Copyright 2015 Endless Mobile, Inc. */
+
+/* This file is part of eos-shard.
+ *
+ * eos-shard is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * eos-shard is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with eos-shard.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+/* Merges several shards into a single V2 shard, keeping only the records
+ * which are visible when the shards are layered in the given order. */
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "eos-shard-shard-file.h"
+#include "eos-shard-shard-set.h"
+#include "eos-shard-writer-v2.h"
+
+static int zstd_level = 3;
+static gboolean record_filter = FALSE;
+
+static GOptionEntry entries[] = {
+  { "zstd-level", 0, 0, G_OPTION_ARG_INT, &zstd_level,
+    "Compression level for blobs that have to be recompressed", "LEVEL" },
+  { "record-filter", 0, 0, G_OPTION_ARG_NONE, &record_filter,
+    "Write a record name filter into the output shard", NULL },
+  { NULL }
+};
+
+/* Whether @b_path names the file described by @a, through links or otherwise. */
+static gboolean
+same_file (const struct stat *a, const char *b_path)
+{
+  struct stat b;
+  return stat (b_path, &b) == 0 && a->st_dev == b.st_dev && a->st_ino == b.st_ino;
+}
+
+int
+main (int argc, char **argv)
+{
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GOptionContext) context = g_option_context_new ("OUTPUT SHARD...");
+  g_option_context_set_summary (context,
+                                "Merges the given shards, highest priority first, into a single shard.\n"
+                                "Records deleted by tombstones or shadowed by higher priority shards\n"
+                                "are dropped.");
+  g_option_context_add_main_entries (context, entries, NULL);
+
+  if (!g_option_context_parse (context, &argc, &argv, &error)) {
+    g_printerr ("%s\n", error->message);
+    return EXIT_FAILURE;
+  }
+
+  if (argc < 3) {
+    g_autofree char *help = g_option_context_get_help (context, TRUE, NULL);
+    g_printerr ("%s", help);
+    return EXIT_FAILURE;
+  }
+
+  const char *output_path = argv[1];
+  GList *shard_files = NULL;
+  int i;
+
+  /* We read from the inputs while writing the output, so the output
+   * can't be one of them. */
+  struct stat output_stat;
+  if (stat (output_path, &output_stat) == 0) {
+    for (i = 2; i < argc; i++) {
+      if (same_file (&output_stat, argv[i])) {
+        g_printerr ("The output %s is also an input\n", output_path);
+        return EXIT_FAILURE;
+      }
+    }
+  }
+
+  for (i = 2; i < argc; i++) {
+    EosShardShardFile *shard_file = g_initable_new (EOS_SHARD_TYPE_SHARD_FILE, NULL, &error,
+                                                    "path", argv[i],
+                                                    NULL);
+    if (shard_file == NULL) {
+      g_printerr ("Could not open %s: %s\n", argv[i], error->message);
+      g_list_free_full (shard_files, g_object_unref);
+      return EXIT_FAILURE;
+    }
+
+    shard_files = g_list_append (shard_files, shard_file);
+  }
+
+  g_autoptr(EosShardShardSet) shard_set = eos_shard_shard_set_new (shard_files);
+  g_list_free_full (shard_files, g_object_unref);
+
+  /* Write to a temporary file next to the output, and only replace the
+   * output once the merged shard is complete. */
+  g_autofree char *output_dir = g_path_get_dirname (output_path);
+  g_autofree char *output_name = g_path_get_basename (output_path);
+  g_autofree char *tmp_name = g_strdup_printf (".%s.XXXXXX", output_name);
+  g_autofree char *tmp_path = g_build_filename (output_dir, tmp_name, NULL);
+
+  int fd = g_mkstemp_full (tmp_path, O_RDWR, 0644);
+  if (fd < 0) {
+    g_printerr ("Could not create %s: %s\n", tmp_path, strerror (errno));
+    return EXIT_FAILURE;
+  }
+
+  g_autoptr(EosShardWriterV2) writer = g_object_new (EOS_SHARD_TYPE_WRITER_V2,
+                                                     "fd", (guint64) fd,
+                                                     "zstd-level", zstd_level,
+                                                     "record-filter", record_filter,
+                                                     NULL);
+
+  if (!eos_shard_writer_v2_add_shard_set (writer, shard_set, &error)) {
+    g_printerr ("Could not merge shards: %s\n", error->message);
+    close (fd);
+    unlink (tmp_path);
+    return EXIT_FAILURE;
+  }
+
+  eos_shard_writer_v2_finish (writer);
+
+  if (fsync (fd) < 0 || close (fd) < 0) {
+    g_printerr ("Could not write %s: %s\n", tmp_path, strerror (errno));
+    unlink (tmp_path);
+    return EXIT_FAILURE;
+  }
+
+  if (rename (tmp_path, output_path) < 0) {
+    g_printerr ("Could not replace %s: %s\n", output_path, strerror (errno));
+    unlink (tmp_path);
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}